@@ -1,4 +1,4 @@
-#include <math.h>
+#include <stdatomic.h>
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -8,6 +8,7 @@
 
 #include "log_tags.h"
 
+#include "pgp_gatts.h"
 #include "pgp_handshake_multi.h"
 
 //#include "esp_adc/adc_oneshot.h"
@@ -19,35 +20,75 @@
 
 #define uS_TO_S 1000000ULL
 
+// how often the battery sampler reads the adc
+#define BATTERY_SAMPLE_INTERVAL_MS 5000
+// weight of a new sample in the filtered voltage
+static const float BATTERY_FILTER_ALPHA = 0.2;
+
 bool disconnected = true;
 
 static esp_adc_cal_characteristics_t adc1_chars;
 
+// last filtered battery percentage, 50 until the first sample
+static atomic_uint battery_level = 50;
+
 float read_battery_voltage()
 {
     float voltage = adc1_get_raw(ADC1_CHANNEL_7) / 4095.0 * 7.1;
 //    uint32_t voltage = esp_adc_cal_raw_to_voltage(adc1_get_raw(ADC1_CHANNEL_7), &adc1_chars);
-    ESP_LOGI("BATTERY", "voltage: %f", voltage );
+    ESP_LOGD("BATTERY", "voltage: %f", voltage );
     return voltage;
 }
 
-uint8_t read_battery_value()
+static uint8_t battery_percentage(float voltage)
+{
+    if (voltage > 4.19) return 100;
+    if (voltage <= 3.00) return 0;
+
+    // li-ion discharge curve fit, horner form of
+    // 3775.5 v^4 - 59209 v^3 + 347670 v^2 - 905717 v + 883083
+    // (double because the terms cancel out from ~1e6 down to 0-100)
+    double v = voltage;
+    double percentage = (((3775.5 * v - 59209) * v + 347670) * v - 905717) * v + 883083;
+    if (percentage > 100) return 100;
+    if (percentage < 0) return 0;
+    return (uint8_t)percentage;
+}
+
+uint8_t get_battery_level()
 {
-    uint8_t percentage = 50; // default value if the measurement failes
-//    uint32_t voltage = esp_adc_cal_raw_to_voltage(adc1_get_raw(ADC1_CHANNEL_7), &adc1_chars); // / 4096.0 * 6.79;
-//    uint32_t raw = adc_get_raw(ADC_UNIT_1, ADC_CHANNEL_7);
-//    uint32_t voltage = adc_cali_raw_to_voltage(adc1_cali_chan1_handle, adc_raw[0][1], &voltage[0][1]));;
-    float voltage = read_battery_voltage();
-    if (voltage > 0.5){ // measurement successful
-        percentage = 3775.5 * pow(voltage, 4) - 59209 * pow(voltage, 3) + 347670 * pow(voltage, 2) - 905717 * voltage + 883083;
-//        percentage = (voltage - 1500) * 100 / (2100 - 1500);
-        if (voltage > 4.19) percentage = 100;
-        else if (voltage <= 3.00) percentage = 0;
-        if (percentage > 100) percentage = 100;
-        else if (percentage < 0) percentage = 0;
+    return atomic_load(&battery_level);
+}
+
+static void battery_sampler_task(void *pvParameters)
+{
+    float filtered_voltage = 0;
+
+    ESP_LOGI("BATTERY", "[battery sampler task start]");
+
+    while (true)
+    {
+        float voltage = read_battery_voltage();
+        if (voltage > 0.5){ // measurement successful
+            if (filtered_voltage == 0)
+            {
+                filtered_voltage = voltage;
+            }
+            else
+            {
+                filtered_voltage += BATTERY_FILTER_ALPHA * (voltage - filtered_voltage);
+            }
+
+            uint8_t percentage = battery_percentage(filtered_voltage);
+            if (percentage != atomic_exchange(&battery_level, percentage))
+            {
+                ESP_LOGI("BATTERY", "voltage: %f percentage: %i", filtered_voltage, percentage );
+                update_battery_level_attr(percentage);
+            }
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(BATTERY_SAMPLE_INTERVAL_MS));
     }
-    ESP_LOGI("BATTERY", "voltage: %f percentage: %i", voltage, percentage );
-    return percentage;
 }
 
 
@@ -116,5 +157,6 @@ void setup_battery_measurement(){
     adc1_config_width(ADC_WIDTH_BIT_DEFAULT);
     adc1_config_channel_atten(ADC1_CHANNEL_7, ADC_ATTEN_DB_11);
     xTaskCreate(overdischarge_protection_task, "overdischarge_protection_task", 2048, NULL, 12, NULL);
+    xTaskCreate(battery_sampler_task, "battery_sampler", 2560, NULL, 5, NULL);
 //    xTaskCreate(power_save_task, "power_save_task", 2048, NULL, 12, NULL);
 }
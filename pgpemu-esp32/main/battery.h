@@ -5,6 +5,7 @@ void setup_battery_measurement();
 
 void power_save_task();
 
-uint8_t read_battery_value();
+// filtered battery percentage from the sampler task, never touches the adc
+uint8_t get_battery_level();
 
 #endif /* BATTERY_H */
@@ -0,0 +1,412 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+#include "gameplay_stats.h"
+
+#include "log_tags.h"
+
+#define MAX_CONNECTIONS CONFIG_BT_ACL_CONNECTIONS
+#define GAMEPLAY_HOURS 24
+#define GAMEPLAY_DAYS 7
+
+static const char *KEY_GAMEPLAY = "gameplay";
+static const uint32_t GAMEPLAY_RECORD_MAGIC = 0x67706c03;
+
+// hours and days count uptime, not wall clock time. the record is written once per hour and only if
+// something happened, so at most one hour of counts is lost on reset. only the days are stored, the
+// hourly slots stay in RAM: that keeps the blob at 12 nvs entries instead of 29, so the 0x6000 nvs
+// partition (5 usable pages of 126 entries) erases a page about every 10 active hours and each of
+// its sectors lasts far longer than the 100k erase cycles of the flash would suggest.
+typedef struct
+{
+    uint32_t magic;
+    // completed hours, hours[hour % GAMEPLAY_HOURS] is the current one
+    uint32_t hour;
+    // days[(hour / 24) % GAMEPLAY_DAYS] is the current one
+    uint32_t days[GAMEPLAY_DAYS][GAMEPLAY_COUNTERS];
+} gameplay_record_t;
+
+// slots are claimed by the BTC task, other tasks only read them
+typedef struct
+{
+    atomic_bool in_use;
+    atomic_bool active;
+    atomic_uint conn_id;
+    atomic_uint since;
+    atomic_uint counts[GAMEPLAY_COUNTERS];
+} gameplay_conn_t;
+
+static const char *gameplay_counter_names[GAMEPLAY_COUNTERS] = {
+    "seen",
+    "caught",
+    "fled",
+    "spun",
+    "bag full",
+    "box full",
+    "balls empty",
+    "caught shakes",
+    "fled shakes",
+    "presses accepted",
+    "presses missed",
+};
+
+// since boot, incremented by the BTC task (and the autobutton task for press outcomes)
+static atomic_uint totals[GAMEPLAY_COUNTERS];
+static gameplay_conn_t conns[MAX_CONNECTIONS];
+
+// record is shared by the gameplay task and the uart task
+static SemaphoreHandle_t record_mutex = NULL;
+static gameplay_record_t record;
+static uint16_t hours[GAMEPLAY_HOURS][GAMEPLAY_COUNTERS];
+// record.hour at boot, hours before that weren't seen
+static uint32_t boot_hour;
+// totals already added to the record, only touched by the gameplay task
+static uint32_t rolled_up[GAMEPLAY_COUNTERS];
+
+static void gameplay_stats_task(void *pvParameters);
+
+// returns false if there was no usable record
+static bool read_record()
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open("stats", NVS_READONLY, &handle);
+    if (err == ESP_OK)
+    {
+        size_t size = sizeof(record);
+        err = nvs_get_blob(handle, KEY_GAMEPLAY, &record, &size);
+        nvs_close(handle);
+        if (err == ESP_OK && (size != sizeof(record) || record.magic != GAMEPLAY_RECORD_MAGIC))
+        {
+            ESP_LOGW(GAMEPLAY_TAG, "stored record has a different format, starting over");
+            err = ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    if (err != ESP_OK)
+    {
+        if (err != ESP_ERR_NVS_NOT_FOUND && err != ESP_ERR_INVALID_SIZE)
+        {
+            ESP_LOGW(GAMEPLAY_TAG, "%s nvs read failed: %s", __func__, esp_err_to_name(err));
+        }
+        memset(&record, 0, sizeof(record));
+        record.magic = GAMEPLAY_RECORD_MAGIC;
+        return false;
+    }
+
+    return true;
+}
+
+static void write_record()
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open("stats", NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(GAMEPLAY_TAG, "%s nvs open failed: %s", __func__, esp_err_to_name(err));
+        return;
+    }
+
+    err = nvs_set_blob(handle, KEY_GAMEPLAY, &record, sizeof(record));
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(GAMEPLAY_TAG, "%s nvs write %s failed: %s", __func__, KEY_GAMEPLAY, esp_err_to_name(err));
+        nvs_close(handle);
+        return;
+    }
+
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// clear the slots of the next hour (and day). returns true if that dropped any counts.
+static bool begin_hour()
+{
+    bool dropped = false;
+
+    record.hour++;
+    uint16_t *hour = hours[record.hour % GAMEPLAY_HOURS];
+    uint32_t *day = record.days[(record.hour / 24) % GAMEPLAY_DAYS];
+    for (int i = 0; i < GAMEPLAY_COUNTERS; i++)
+    {
+        dropped = dropped || hour[i];
+        hour[i] = 0;
+        if (record.hour % 24 == 0)
+        {
+            dropped = dropped || day[i];
+            day[i] = 0;
+        }
+    }
+
+    return dropped;
+}
+
+void init_gameplay_stats()
+{
+    record_mutex = xSemaphoreCreateMutex();
+    if (read_record())
+    {
+        // the hour before the reset is incomplete, don't add to it
+        begin_hour();
+    }
+    boot_hour = record.hour;
+
+    xTaskCreate(gameplay_stats_task, "gameplay_stats", 3072, NULL, 9, NULL);
+}
+
+static gameplay_conn_t *get_conn(uint16_t conn_id)
+{
+    gameplay_conn_t *reuse = NULL;
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        gameplay_conn_t *conn = &conns[i];
+        if (atomic_load(&conn->active))
+        {
+            if (atomic_load(&conn->conn_id) == conn_id)
+            {
+                return conn;
+            }
+        }
+        else if (!reuse || !atomic_load(&conn->in_use) ||
+                 (atomic_load(&reuse->in_use) && atomic_load(&conn->since) < atomic_load(&reuse->since)))
+        {
+            // prefer unused slots, then the oldest ended connection
+            reuse = conn;
+        }
+    }
+
+    if (reuse)
+    {
+        for (int i = 0; i < GAMEPLAY_COUNTERS; i++)
+        {
+            atomic_store(&reuse->counts[i], 0);
+        }
+        atomic_store(&reuse->conn_id, conn_id);
+        atomic_store(&reuse->since, xTaskGetTickCount());
+        atomic_store(&reuse->active, true);
+        atomic_store(&reuse->in_use, true);
+    }
+    return reuse;
+}
+
+static void count(gameplay_conn_t *conn, gameplay_counter_t counter, int n)
+{
+    atomic_fetch_add_explicit(&totals[counter], n, memory_order_relaxed);
+    if (conn)
+    {
+        atomic_fetch_add_explicit(&conn->counts[counter], n, memory_order_relaxed);
+    }
+}
+
+void gameplay_stats_record(uint16_t conn_id, led_event_t event, int ballshakes)
+{
+    gameplay_conn_t *conn = get_conn(conn_id);
+
+    switch (event)
+    {
+    case LED_EVENT_POKEMON:
+    case LED_EVENT_NEW_POKEMON:
+        count(conn, GAMEPLAY_SEEN, 1);
+        break;
+    case LED_EVENT_CAUGHT:
+        count(conn, GAMEPLAY_CAUGHT, 1);
+        count(conn, GAMEPLAY_CAUGHT_SHAKES, ballshakes);
+        break;
+    case LED_EVENT_FLED:
+        count(conn, GAMEPLAY_FLED, 1);
+        count(conn, GAMEPLAY_FLED_SHAKES, ballshakes);
+        break;
+    case LED_EVENT_ITEMS:
+        count(conn, GAMEPLAY_SPUN, 1);
+        break;
+    case LED_EVENT_BAG_FULL:
+        count(conn, GAMEPLAY_BAG_FULL, 1);
+        break;
+    case LED_EVENT_BOX_FULL:
+        count(conn, GAMEPLAY_BOX_FULL, 1);
+        break;
+    case LED_EVENT_BALLS_EMPTY:
+        count(conn, GAMEPLAY_BALLS_EMPTY, 1);
+        break;
+    default:
+        break;
+    }
+}
+
+void gameplay_stats_press_outcome(bool accepted)
+{
+    count(NULL, accepted ? GAMEPLAY_PRESS_ACCEPTED : GAMEPLAY_PRESS_MISSED, 1);
+}
+
+void gameplay_stats_disconnect(uint16_t conn_id)
+{
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        if (atomic_load(&conns[i].active) && atomic_load(&conns[i].conn_id) == conn_id)
+        {
+            atomic_store(&conns[i].active, false);
+        }
+    }
+}
+
+static void gameplay_stats_task(void *pvParameters)
+{
+    TickType_t previousWakeTime = xTaskGetTickCount();
+
+    ESP_LOGI(GAMEPLAY_TAG, "task start, %lu hours recorded", record.hour);
+
+    while (true)
+    {
+        vTaskDelayUntil(&previousWakeTime, pdMS_TO_TICKS(60 * 60 * 1000));
+
+        if (!xSemaphoreTake(record_mutex, portMAX_DELAY))
+        {
+            continue;
+        }
+
+        bool dirty = false;
+        uint16_t *hour = hours[record.hour % GAMEPLAY_HOURS];
+        uint32_t *day = record.days[(record.hour / 24) % GAMEPLAY_DAYS];
+        for (int i = 0; i < GAMEPLAY_COUNTERS; i++)
+        {
+            uint32_t total = atomic_load_explicit(&totals[i], memory_order_relaxed);
+            uint32_t delta = total - rolled_up[i];
+            rolled_up[i] = total;
+            if (delta)
+            {
+                hour[i] = hour[i] + delta > UINT16_MAX ? UINT16_MAX : hour[i] + delta;
+                day[i] += delta;
+                dirty = true;
+            }
+        }
+        dirty = begin_hour() || dirty;
+
+        // idle hours aren't written, hour then lags behind after a reset but the flash isn't worn
+        if (dirty)
+        {
+            write_record();
+        }
+
+        xSemaphoreGive(record_mutex);
+    }
+
+    vTaskDelete(NULL);
+}
+
+// "name=value, ..." of all non-zero counters and the press success rate
+static void format_counters(char *buf, size_t size, const uint32_t *values)
+{
+    int pos = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < GAMEPLAY_COUNTERS && pos < (int)size; i++)
+    {
+        if (values[i])
+        {
+            pos += snprintf(buf + pos, size - pos, "%s%s=%lu", pos ? ", " : "", gameplay_counter_names[i], values[i]);
+        }
+    }
+    uint32_t presses = values[GAMEPLAY_PRESS_ACCEPTED] + values[GAMEPLAY_PRESS_MISSED];
+    if (presses && pos < (int)size)
+    {
+        snprintf(buf + pos, size - pos, ", press success=%lu%%", 100 * values[GAMEPLAY_PRESS_ACCEPTED] / presses);
+    }
+    if (!pos)
+    {
+        snprintf(buf, size, "nothing");
+    }
+}
+
+static void dump_rates(const char *what, const uint32_t *values, uint32_t minutes)
+{
+    if (!minutes)
+    {
+        return;
+    }
+    ESP_LOGI(GAMEPLAY_TAG, "%s: %lu catches/h, %lu spins/h, avg shakes caught=%lu.%lu fled=%lu.%lu", what,
+             values[GAMEPLAY_CAUGHT] * 60 / minutes, values[GAMEPLAY_SPUN] * 60 / minutes,
+             values[GAMEPLAY_CAUGHT] ? values[GAMEPLAY_CAUGHT_SHAKES] / values[GAMEPLAY_CAUGHT] : 0,
+             values[GAMEPLAY_CAUGHT] ? values[GAMEPLAY_CAUGHT_SHAKES] * 10 / values[GAMEPLAY_CAUGHT] % 10 : 0,
+             values[GAMEPLAY_FLED] ? values[GAMEPLAY_FLED_SHAKES] / values[GAMEPLAY_FLED] : 0,
+             values[GAMEPLAY_FLED] ? values[GAMEPLAY_FLED_SHAKES] * 10 / values[GAMEPLAY_FLED] % 10 : 0);
+}
+
+void dump_gameplay_stats()
+{
+    // static to keep it off the uart task stack
+    static gameplay_record_t snapshot;
+    static uint16_t hours_snapshot[GAMEPLAY_HOURS][GAMEPLAY_COUNTERS];
+    char line[256];
+    uint32_t values[GAMEPLAY_COUNTERS];
+
+    uint32_t uptime_min = esp_timer_get_time() / (60 * 1000000LL);
+    for (int i = 0; i < GAMEPLAY_COUNTERS; i++)
+    {
+        values[i] = atomic_load(&totals[i]);
+    }
+    format_counters(line, sizeof(line), values);
+    ESP_LOGI(GAMEPLAY_TAG, "since boot (%lu min): %s", uptime_min, line);
+    dump_rates("since boot", values, uptime_min);
+
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        gameplay_conn_t *conn = &conns[i];
+        if (!atomic_load(&conn->in_use))
+        {
+            continue;
+        }
+        for (int j = 0; j < GAMEPLAY_COUNTERS; j++)
+        {
+            values[j] = atomic_load(&conn->counts[j]);
+        }
+        uint32_t minutes = pdTICKS_TO_MS(now - atomic_load(&conn->since)) / 60000;
+        format_counters(line, sizeof(line), values);
+        ESP_LOGI(GAMEPLAY_TAG, "- conn_id=%u%s, %lu min: %s", atomic_load(&conn->conn_id),
+                 atomic_load(&conn->active) ? "" : " (ended)", minutes, line);
+        if (atomic_load(&conn->active))
+        {
+            dump_rates("  rates", values, minutes);
+        }
+    }
+
+    if (!record_mutex || !xSemaphoreTake(record_mutex, portMAX_DELAY))
+    {
+        return;
+    }
+    memcpy(&snapshot, &record, sizeof(snapshot));
+    memcpy(hours_snapshot, hours, sizeof(hours_snapshot));
+    xSemaphoreGive(record_mutex);
+
+    ESP_LOGI(GAMEPLAY_TAG, "last hours (since boot):");
+    for (uint32_t ago = 1; ago <= GAMEPLAY_HOURS && ago <= snapshot.hour - boot_hour; ago++)
+    {
+        uint16_t *hour = hours_snapshot[(snapshot.hour - ago) % GAMEPLAY_HOURS];
+        bool any = false;
+        for (int i = 0; i < GAMEPLAY_COUNTERS; i++)
+        {
+            values[i] = hour[i];
+            any = any || hour[i];
+        }
+        if (any)
+        {
+            format_counters(line, sizeof(line), values);
+            ESP_LOGI(GAMEPLAY_TAG, "- %lu h ago: %s", ago, line);
+        }
+    }
+
+    ESP_LOGI(GAMEPLAY_TAG, "last days (of uptime, stored):");
+    uint32_t today = snapshot.hour / 24;
+    for (uint32_t ago = 0; ago < GAMEPLAY_DAYS && ago <= today; ago++)
+    {
+        format_counters(line, sizeof(line), snapshot.days[(today - ago) % GAMEPLAY_DAYS]);
+        ESP_LOGI(GAMEPLAY_TAG, "- %lu d ago: %s", ago, line);
+    }
+}
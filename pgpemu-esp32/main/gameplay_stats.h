@@ -0,0 +1,40 @@
+#ifndef GAMEPLAY_STATS_H
+#define GAMEPLAY_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgp_led_pattern.h"
+
+typedef enum
+{
+    GAMEPLAY_SEEN = 0,
+    GAMEPLAY_CAUGHT,
+    GAMEPLAY_FLED,
+    GAMEPLAY_SPUN,
+    GAMEPLAY_BAG_FULL,
+    GAMEPLAY_BOX_FULL,
+    GAMEPLAY_BALLS_EMPTY,
+    // sum of ball shakes before catches/flees, divide by GAMEPLAY_CAUGHT/GAMEPLAY_FLED for the average
+    GAMEPLAY_CAUGHT_SHAKES,
+    GAMEPLAY_FLED_SHAKES,
+    // auto button presses the app reacted to or not, see pgp_autobutton.c
+    GAMEPLAY_PRESS_ACCEPTED,
+    GAMEPLAY_PRESS_MISSED,
+    GAMEPLAY_COUNTERS,
+} gameplay_counter_t;
+
+// loads the stored hourly/daily aggregates and starts the task rolling them up
+void init_gameplay_stats();
+
+// BTC task only: count a classified led event of conn_id
+void gameplay_stats_record(uint16_t conn_id, led_event_t event, int ballshakes);
+// any task: count the outcome of an auto button press (only in the totals, not per connection)
+void gameplay_stats_press_outcome(bool accepted);
+// BTC task only: the per connection counters of conn_id stay visible until the slot is reused
+void gameplay_stats_disconnect(uint16_t conn_id);
+
+// print counters since boot, per connection and the stored aggregates
+void dump_gameplay_stats();
+
+#endif /* GAMEPLAY_STATS_H */
@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "histogram.h"
+
+static int bucket_index(uint32_t value)
+{
+    if (value == 0)
+    {
+        return 0;
+    }
+
+    int idx = 32 - __builtin_clz(value);
+    if (idx >= HISTOGRAM_BUCKETS)
+    {
+        idx = HISTOGRAM_BUCKETS - 1;
+    }
+    return idx;
+}
+
+void histogram_add(histogram_t *hist, uint32_t value)
+{
+    hist->buckets[bucket_index(value)]++;
+    hist->sum += value;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+    hist->count++;
+}
+
+void histogram_reset(histogram_t *hist)
+{
+    hist->count = 0;
+    hist->max = 0;
+    hist->sum = 0;
+    memset(hist->buckets, 0, sizeof(hist->buckets));
+}
+
+void histogram_dump(const char *tag, const histogram_t *hist)
+{
+    uint32_t count = hist->count;
+    if (count == 0)
+    {
+        ESP_LOGI(tag, "%s: no samples", hist->name);
+        return;
+    }
+
+    ESP_LOGI(tag, "%s: n=%lu, avg=%lu %s, max=%lu %s",
+             hist->name, count, (uint32_t)(hist->sum / count), hist->unit,
+             hist->max, hist->unit);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        if (!hist->buckets[i])
+        {
+            continue;
+        }
+
+        if (i == HISTOGRAM_BUCKETS - 1)
+        {
+            ESP_LOGI(tag, "  >= %lu %s: %lu", 1UL << (i - 1), hist->unit, hist->buckets[i]);
+        }
+        else
+        {
+            ESP_LOGI(tag, "  < %lu %s: %lu", 1UL << i, hist->unit, hist->buckets[i]);
+        }
+    }
+}
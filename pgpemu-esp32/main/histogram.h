@@ -0,0 +1,31 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// bucket 0 counts value 0, bucket i counts values from 2^(i-1) to 2^i-1,
+// the last bucket also takes everything bigger
+#define HISTOGRAM_BUCKETS 20
+
+// histograms have a single writer. readers may see a sample which is counted
+// in buckets but not yet in count, which is fine for statistics.
+typedef struct
+{
+    const char *name;
+    const char *unit;
+
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+#define HISTOGRAM_INIT(_name, _unit) {.name = (_name), .unit = (_unit)}
+
+void histogram_add(histogram_t *hist, uint32_t value);
+void histogram_reset(histogram_t *hist);
+
+// print non-empty buckets to log
+void histogram_dump(const char *tag, const histogram_t *hist);
+
+#endif /* HISTOGRAM_H */
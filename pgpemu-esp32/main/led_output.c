@@ -7,6 +7,7 @@
 #include "led_output.h"
 
 #include "log_tags.h"
+#include "pgp_conn_events.h"
 #include "settings.h"
 
 typedef struct
@@ -21,6 +22,7 @@ static const int CONFIG_GPIO_OUTPUT_BLUE = GPIO_NUM_25;
 
 static void leds_off();
 static void led_output_task(void *pvParameters);
+static void led_conn_event_handler(const conn_event_t *event);
 
 static QueueHandle_t led_queue;
 
@@ -41,6 +43,22 @@ void init_led_output()
     led_queue = xQueueCreate(10, sizeof(LedEvent));
     led_ready = true;
     xTaskCreate(led_output_task, "led_output_task", 2048, NULL, 14, NULL);
+
+    conn_events_subscribe(led_conn_event_handler);
+}
+
+static void led_conn_event_handler(const conn_event_t *event)
+{
+    if (event->type == CONN_EVENT_HANDSHAKE_COMPLETE && event->active_connections == 1)
+    {
+        // turn leds off
+        show_rgb_event(false, false, false, 0);
+    }
+    else if (event->type == CONN_EVENT_DISCONNECTED && event->active_connections == 0)
+    {
+        // show blue as long as nobody is connected
+        show_rgb_event(false, false, true, 0);
+    }
 }
 
 void show_rgb_event(bool red, bool green, bool blue, int duration_ms)
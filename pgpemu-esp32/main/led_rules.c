@@ -0,0 +1,195 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "led_rules.h"
+
+#include "log_tags.h"
+
+static const char *KEY_RULES = "rules";
+
+// bump when led_rule_t changes, older blobs are ignored then
+static const uint32_t LED_RULES_MAGIC = 0x6c727501;
+
+// nvs blob, only the first count rules are stored
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    led_rule_t rules[LED_RULES_MAX];
+} led_rules_blob_t;
+
+#define LED_RULES_BLOB_HEADER offsetof(led_rules_blob_t, rules)
+
+// edited by the uart task only
+static led_rule_t rules[LED_RULES_MAX];
+static int rule_count = 0;
+
+// compiled led_action_t per signature, one word each so the BTC task never sees half an update
+static atomic_uint compiled[256];
+
+_Static_assert(sizeof(led_action_t) == sizeof(uint32_t), "led_action_t must fit into one word");
+
+static void compile()
+{
+    // static to keep it off the task stack
+    static led_action_t table[256];
+
+    led_rules_compile(rules, rule_count, table);
+    for (int sig = 0; sig < 256; sig++)
+    {
+        uint32_t word;
+        memcpy(&word, &table[sig], sizeof(word));
+        atomic_store_explicit(&compiled[sig], word, memory_order_relaxed);
+    }
+}
+
+void init_led_rules()
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open("led_rules", NVS_READONLY, &handle);
+    if (err == ESP_OK)
+    {
+        static led_rules_blob_t blob;
+        size_t size = sizeof(blob);
+        err = nvs_get_blob(handle, KEY_RULES, &blob, &size);
+        nvs_close(handle);
+        if (err == ESP_OK)
+        {
+            bool valid = size >= LED_RULES_BLOB_HEADER && blob.magic == LED_RULES_MAGIC &&
+                         blob.count <= LED_RULES_MAX &&
+                         size == LED_RULES_BLOB_HEADER + blob.count * sizeof(led_rule_t);
+            for (uint32_t i = 0; valid && i < blob.count; i++)
+            {
+                valid = led_rule_valid(&blob.rules[i]);
+            }
+
+            if (valid)
+            {
+                memcpy(rules, blob.rules, blob.count * sizeof(led_rule_t));
+                rule_count = blob.count;
+            }
+            else
+            {
+                ESP_LOGE(LED_RULES_TAG, "stored rules are invalid, ignoring them");
+            }
+        }
+    }
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND)
+    {
+        ESP_LOGE(LED_RULES_TAG, "%s nvs read failed: %s", __func__, esp_err_to_name(err));
+    }
+
+    compile();
+    ESP_LOGI(LED_RULES_TAG, "%d led rules loaded", rule_count);
+}
+
+led_action_t led_rules_lookup(uint8_t signature)
+{
+    uint32_t word = atomic_load_explicit(&compiled[signature], memory_order_relaxed);
+    led_action_t action;
+    memcpy(&action, &word, sizeof(action));
+    return action;
+}
+
+bool led_rules_add(const led_rule_t *rule)
+{
+    if (rule_count >= LED_RULES_MAX || !led_rule_valid(rule))
+    {
+        return false;
+    }
+    rules[rule_count++] = *rule;
+    compile();
+    return true;
+}
+
+bool led_rules_delete(int idx)
+{
+    if (idx < 0 || idx >= rule_count)
+    {
+        return false;
+    }
+    memmove(&rules[idx], &rules[idx + 1], (rule_count - idx - 1) * sizeof(led_rule_t));
+    rule_count--;
+    compile();
+    return true;
+}
+
+void led_rules_clear()
+{
+    rule_count = 0;
+    compile();
+}
+
+bool led_rules_save()
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open("led_rules", NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(LED_RULES_TAG, "%s nvs open failed: %s", __func__, esp_err_to_name(err));
+        return false;
+    }
+
+    if (rule_count)
+    {
+        static led_rules_blob_t blob;
+        blob.magic = LED_RULES_MAGIC;
+        blob.count = rule_count;
+        memcpy(blob.rules, rules, rule_count * sizeof(led_rule_t));
+        err = nvs_set_blob(handle, KEY_RULES, &blob, LED_RULES_BLOB_HEADER + rule_count * sizeof(led_rule_t));
+    }
+    else
+    {
+        err = nvs_erase_key(handle, KEY_RULES);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            err = ESP_OK;
+        }
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(LED_RULES_TAG, "%s nvs write failed: %s", __func__, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+static const char *action_name(uint8_t action)
+{
+    switch (action)
+    {
+    case LED_ACTION_PRESS:
+        return "press";
+    case LED_ACTION_IGNORE:
+        return "ignore";
+    default:
+        return "default";
+    }
+}
+
+void led_rules_dump()
+{
+    ESP_LOGI(LED_RULES_TAG, "%d of %d rules:", rule_count, LED_RULES_MAX);
+    for (int i = 0; i < rule_count; i++)
+    {
+        const led_rule_t *rule = &rules[i];
+        uint8_t feedback = rule->then.feedback;
+        ESP_LOGI(LED_RULES_TAG, "- %d: sig=%02x mask=%02x -> %s, led=%s%s%s%s, delay=%d-%d ms", i,
+                 rule->value, rule->mask, action_name(rule->then.action),
+                 !(feedback & LED_FEEDBACK_SET) ? "default" : (feedback & ~LED_FEEDBACK_SET) ? "" : "off",
+                 feedback & LED_FEEDBACK_RED ? "r" : "",
+                 feedback & LED_FEEDBACK_GREEN ? "g" : "",
+                 feedback & LED_FEEDBACK_BLUE ? "b" : "",
+                 rule->then.delay_min * 100, rule->then.delay_max * 100);
+    }
+}
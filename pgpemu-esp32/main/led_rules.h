@@ -0,0 +1,24 @@
+#ifndef LED_RULES_H
+#define LED_RULES_H
+
+#include <stdbool.h>
+
+#include "pgp_led_pattern.h"
+
+#define LED_RULES_MAX 16
+
+// load the rules from nvs and compile them
+void init_led_rules();
+
+// any task: O(1), all zero (defaults) if no rule matches
+led_action_t led_rules_lookup(uint8_t signature);
+
+// uart task only: edits take effect right away, led_rules_save() makes them permanent
+bool led_rules_add(const led_rule_t *rule);
+bool led_rules_delete(int idx);
+void led_rules_clear();
+bool led_rules_save();
+
+void led_rules_dump();
+
+#endif /* LED_RULES_H */
@@ -12,10 +12,15 @@ void log_levels_init()
     esp_log_level_set(CERT_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(CONFIG_SECRETS_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(CONFIG_STORAGE_TAG, ESP_LOG_DEBUG);
+    esp_log_level_set(CONN_EVENTS_TAG, ESP_LOG_DEBUG);
+    esp_log_level_set(CONN_PARAMS_TAG, ESP_LOG_DEBUG);
+    esp_log_level_set(GAMEPLAY_TAG, ESP_LOG_DEBUG);
+    esp_log_level_set(GATTS_TX_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(HANDSHAKE_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(PGPEMU_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(LEDHANDLER_TAG, ESP_LOG_INFO);
     esp_log_level_set(LEDOUTPUT_TAG, ESP_LOG_INFO);
+    esp_log_level_set(LED_RULES_TAG, ESP_LOG_INFO);
     esp_log_level_set(POWERBANK_TASK_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(STATS_TAG, ESP_LOG_DEBUG);
     esp_log_level_set(UART_TAG, ESP_LOG_INFO);
@@ -31,10 +36,15 @@ void log_levels_max()
     esp_log_level_set(CERT_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(CONFIG_SECRETS_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(CONFIG_STORAGE_TAG, ESP_LOG_VERBOSE);
+    esp_log_level_set(CONN_EVENTS_TAG, ESP_LOG_VERBOSE);
+    esp_log_level_set(CONN_PARAMS_TAG, ESP_LOG_VERBOSE);
+    esp_log_level_set(GAMEPLAY_TAG, ESP_LOG_VERBOSE);
+    esp_log_level_set(GATTS_TX_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(HANDSHAKE_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(PGPEMU_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(LEDHANDLER_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(LEDOUTPUT_TAG, ESP_LOG_VERBOSE);
+    esp_log_level_set(LED_RULES_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(POWERBANK_TASK_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(STATS_TAG, ESP_LOG_VERBOSE);
     esp_log_level_set(UART_TAG, ESP_LOG_VERBOSE);
@@ -50,10 +60,15 @@ void log_levels_min()
     esp_log_level_set(CERT_TAG, ESP_LOG_INFO);
     esp_log_level_set(CONFIG_SECRETS_TAG, ESP_LOG_INFO);
     esp_log_level_set(CONFIG_STORAGE_TAG, ESP_LOG_INFO);
+    esp_log_level_set(CONN_EVENTS_TAG, ESP_LOG_INFO);
+    esp_log_level_set(CONN_PARAMS_TAG, ESP_LOG_INFO);
+    esp_log_level_set(GAMEPLAY_TAG, ESP_LOG_INFO);
+    esp_log_level_set(GATTS_TX_TAG, ESP_LOG_INFO);
     esp_log_level_set(HANDSHAKE_TAG, ESP_LOG_INFO);
     esp_log_level_set(PGPEMU_TAG, ESP_LOG_INFO);
     esp_log_level_set(LEDHANDLER_TAG, ESP_LOG_INFO);
     esp_log_level_set(LEDOUTPUT_TAG, ESP_LOG_INFO);
+    esp_log_level_set(LED_RULES_TAG, ESP_LOG_INFO);
     esp_log_level_set(POWERBANK_TASK_TAG, ESP_LOG_INFO);
     esp_log_level_set(STATS_TAG, ESP_LOG_INFO);
     esp_log_level_set(UART_TAG, ESP_LOG_INFO);
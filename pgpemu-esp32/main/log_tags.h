@@ -18,9 +18,14 @@ static const char BUTTON_TASK_TAG[] = "pgp_autobutton";
 static const char CERT_TAG[] = "pgp_cert";
 static const char CONFIG_SECRETS_TAG[] = "config_secrets";
 static const char CONFIG_STORAGE_TAG[] = "config_storage";
+static const char CONN_EVENTS_TAG[] = "conn_events";
+static const char CONN_PARAMS_TAG[] = "conn_params";
+static const char GAMEPLAY_TAG[] = "gameplay_stats";
+static const char GATTS_TX_TAG[] = "pgp_gatts_tx";
 static const char HANDSHAKE_TAG[] = "pgp_handshake";
 static const char LEDHANDLER_TAG[] = "pgp_led";
 static const char LEDOUTPUT_TAG[] = "led_output";
+static const char LED_RULES_TAG[] = "led_rules";
 static const char PGPEMU_TAG[] = "PGPEMU";
 static const char POWERBANK_TASK_TAG[] = "powerbank";
 static const char STATS_TAG[] = "stats";
@@ -0,0 +1,225 @@
+#ifndef ESP_PLATFORM
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../pgp_led_pattern.h"
+
+// replays a corpus of captured LED writes (see led-corpus.txt) through the classifier
+// usage: led-replay [corpus] [passes]
+
+#define MAX_SAMPLES 1024
+#define MAX_WRITE_LEN (4 + 3 * 31)
+
+typedef struct
+{
+	int line;
+	led_event_t expected;
+	uint16_t len;
+	uint8_t data[MAX_WRITE_LEN];
+} sample_t;
+
+static sample_t samples[MAX_SAMPLES];
+
+// corpus labels are the event names with '_' instead of ' '
+static int event_from_label(const char *label)
+{
+	for (int i = 0; i < LED_EVENTS; i++)
+	{
+		const char *name = led_event_names[i];
+		size_t n = strlen(name);
+		if (strlen(label) != n)
+		{
+			continue;
+		}
+		size_t j = 0;
+		while (j < n && (label[j] == name[j] || (label[j] == '_' && name[j] == ' ')))
+		{
+			j++;
+		}
+		if (j == n)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int parse_hex(const char *hex, uint8_t *out, int max_len)
+{
+	int len = 0;
+	while (isxdigit((unsigned char)hex[0]) && isxdigit((unsigned char)hex[1]))
+	{
+		if (len == max_len)
+		{
+			return -1;
+		}
+		unsigned int byte;
+		sscanf(hex, "%2x", &byte);
+		out[len++] = byte;
+		hex += 2;
+	}
+	return (*hex == 0 || isspace((unsigned char)*hex)) ? len : -1;
+}
+
+static int load_corpus(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+
+	char line[1024], label[64], hex[512];
+	int count = 0, lineno = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		lineno++;
+		if (line[0] == '#' || sscanf(line, "%63s %511s", label, hex) < 1)
+		{
+			continue;
+		}
+
+		int event = event_from_label(label);
+		if (event < 0)
+		{
+			fprintf(stderr, "%s:%d: unknown event '%s'\n", path, lineno, label);
+			continue;
+		}
+		if (count == MAX_SAMPLES)
+		{
+			fprintf(stderr, "%s: more than %d samples, ignoring the rest\n", path, MAX_SAMPLES);
+			break;
+		}
+
+		sample_t *sample = &samples[count];
+		memset(sample, 0, sizeof(sample_t));
+		int len = parse_hex(hex, sample->data, MAX_WRITE_LEN);
+		if (len < 4)
+		{
+			fprintf(stderr, "%s:%d: bad hex\n", path, lineno);
+			continue;
+		}
+		sample->line = lineno;
+		sample->expected = event;
+		sample->len = len;
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+static led_event_t classify(const sample_t *sample)
+{
+	led_pattern_t pattern;
+	if (!led_pattern_parse(sample->data, sample->len, &pattern))
+	{
+		return LED_EVENT_UNKNOWN;
+	}
+	return led_pattern_classify(pattern.signature);
+}
+
+static void print_confusion(int confusion[LED_EVENTS][LED_EVENTS])
+{
+	printf("confusion matrix (rows expected, columns classified):\n%14s", "");
+	for (int col = 0; col < LED_EVENTS; col++)
+	{
+		printf(" %3d", col);
+	}
+	printf("\n");
+	for (int row = 0; row < LED_EVENTS; row++)
+	{
+		printf("%2d %-11.11s", row, led_event_names[row]);
+		for (int col = 0; col < LED_EVENTS; col++)
+		{
+			if (confusion[row][col])
+			{
+				printf(" %3d", confusion[row][col]);
+			}
+			else
+			{
+				printf("   .");
+			}
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "main/pc/led-corpus.txt";
+	int passes = argc > 2 ? atoi(argv[2]) : 100000;
+
+	init_led_patterns();
+
+	int count = load_corpus(path);
+	if (count <= 0)
+	{
+		fprintf(stderr, "no samples in %s\n", path);
+		return 1;
+	}
+
+	static int confusion[LED_EVENTS][LED_EVENTS];
+	int correct = 0;
+	for (int i = 0; i < count; i++)
+	{
+		led_event_t event = classify(&samples[i]);
+		confusion[samples[i].expected][event]++;
+		if (event == samples[i].expected)
+		{
+			correct++;
+		}
+		else
+		{
+			printf("%s:%d: expected %s, classified as %s\n", path, samples[i].line,
+				   led_event_names[samples[i].expected], led_event_names[event]);
+		}
+	}
+
+	print_confusion(confusion);
+	printf("accuracy: %d/%d (%.1f%%)\n", correct, count, 100.0 * correct / count);
+
+	volatile int sink = 0;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			sink += classify(&samples[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d passes: %.0f classifications/s\n", passes, (double)passes * count / seconds);
+
+	// same again through the cache the firmware uses
+	static led_cache_t cache;
+	led_pattern_t pattern;
+	led_event_t event;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int pass = 0; pass < passes; pass++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (led_pattern_classify_cached(&cache, samples[i].data, samples[i].len, &pattern, &event))
+			{
+				sink += event;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d passes cached: %.0f classifications/s, hit rate %.1f%%\n", passes, (double)passes * count / seconds,
+		   100.0 * cache.hits / (cache.hits + cache.misses));
+
+	return correct == count ? 0 : 1;
+}
+
+#endif
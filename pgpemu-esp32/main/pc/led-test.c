@@ -0,0 +1,355 @@
+#ifndef ESP_PLATFORM
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../pgp_led_pattern.h"
+
+// one pattern entry: duration in 50 ms, 4 bit per color channel
+struct entry
+{
+	uint8_t duration;
+	uint8_t red, green, blue;
+};
+
+// build an LED characteristic write from entries
+static int make_pattern(uint8_t *buffer, const struct entry *entries, int count)
+{
+	memset(buffer, 0, 4 + 3 * 31);
+	buffer[3] = count & 0x1f;
+	for (int i = 0; i < count; i++)
+	{
+		uint8_t *pat = &buffer[4 + 3 * i];
+		pat[0] = entries[i].duration;
+		pat[1] = entries[i].green << 4 | entries[i].red;
+		pat[2] = entries[i].blue;
+	}
+	return 4 + 3 * count;
+}
+
+// the counting if/else cascade led_pattern_decide() replaced, kept to check the table against it
+static led_event_t classify_reference(const uint8_t *buffer)
+{
+	int number_of_patterns = buffer[3] & 0x1f;
+	int count_ballshake = 0;
+	int count_red = 0, count_green = 0, count_blue = 0, count_yellow = 0, count_white = 0;
+	int count_off = 0, count_notoff = 0;
+
+	for (int i = 0; i < number_of_patterns; i++)
+	{
+		const uint8_t *pat = &buffer[4 + 3 * i];
+		uint8_t red = pat[1] & 0xf;
+		uint8_t green = (pat[1] >> 4) & 0xf;
+		uint8_t blue = pat[2] & 0xf;
+
+		if (!red && !green && !blue)
+		{
+			count_off++;
+			continue;
+		}
+		count_notoff++;
+		if (i <= 3 * 3 && red && green && blue)
+		{
+			count_ballshake++;
+		}
+		if (red && !green && !blue)
+			count_red++;
+		else if (!red && green && !blue)
+			count_green++;
+		else if (!red && !green && blue)
+			count_blue++;
+		else if (red && green && !blue)
+			count_yellow++;
+		else if (red && green && blue)
+			count_white++;
+	}
+
+	if (count_off && !count_notoff)
+		return LED_EVENT_OFF;
+	if (count_white && count_white == count_notoff)
+		return LED_EVENT_BAG_FULL;
+	if (count_red && count_off && count_red == count_notoff)
+		return LED_EVENT_BALLS_EMPTY;
+	if (count_red && !count_off && count_red == count_notoff)
+		return LED_EVENT_BOX_FULL;
+	if (count_green && count_green == count_notoff)
+		return LED_EVENT_POKEMON;
+	if (count_yellow && count_yellow == count_notoff)
+		return LED_EVENT_NEW_POKEMON;
+	if (count_blue && count_blue == count_notoff)
+		return LED_EVENT_POKESTOP;
+	if (count_ballshake)
+	{
+		if (count_blue && count_green)
+			return LED_EVENT_CAUGHT;
+		if (count_red)
+			return LED_EVENT_FLED;
+		return LED_EVENT_SHAKE_UNKNOWN;
+	}
+	if (count_red && count_green && count_blue && !count_off)
+		return LED_EVENT_ITEMS;
+	return LED_EVENT_UNKNOWN;
+}
+
+static void test_table()
+{
+	printf("--------------- classification table ------------\n");
+	for (int sig = 0; sig < 256; sig++)
+	{
+		assert(led_pattern_classify(sig) == led_pattern_decide(sig));
+	}
+}
+
+static void check_pattern(const char *name, const struct entry *entries, int count, led_event_t expected)
+{
+	uint8_t buffer[4 + 3 * 31];
+	led_pattern_t pattern;
+
+	int len = make_pattern(buffer, entries, count);
+	assert(led_pattern_parse(buffer, len, &pattern));
+	led_event_t event = led_pattern_classify(pattern.signature);
+	printf("%-14s signature=%02x ballshakes=%d duration=%d -> %s\n",
+		   name, pattern.signature, pattern.ballshakes, pattern.duration * 50, led_event_names[event]);
+	assert(event == expected);
+	assert(event == classify_reference(buffer));
+}
+
+static void test_known_patterns()
+{
+	printf("--------------- known patterns ------------\n");
+
+	const struct entry off[] = {{1, 0, 0, 0}};
+	check_pattern("off", off, 1, LED_EVENT_OFF);
+
+	const struct entry bag_full[] = {{20, 8, 8, 8}};
+	check_pattern("bag full", bag_full, 1, LED_EVENT_BAG_FULL);
+
+	const struct entry balls_empty[] = {{5, 15, 0, 0}, {5, 0, 0, 0}, {5, 15, 0, 0}, {5, 0, 0, 0}};
+	check_pattern("balls empty", balls_empty, 4, LED_EVENT_BALLS_EMPTY);
+
+	const struct entry box_full[] = {{20, 15, 0, 0}};
+	check_pattern("box full", box_full, 1, LED_EVENT_BOX_FULL);
+
+	const struct entry pokemon[] = {{5, 0, 15, 0}, {5, 0, 0, 0}, {5, 0, 15, 0}, {5, 0, 0, 0}};
+	check_pattern("pokemon", pokemon, 4, LED_EVENT_POKEMON);
+
+	const struct entry new_pokemon[] = {{5, 15, 15, 0}, {5, 0, 0, 0}, {5, 15, 15, 0}, {5, 0, 0, 0}};
+	check_pattern("new pokemon", new_pokemon, 4, LED_EVENT_NEW_POKEMON);
+
+	const struct entry pokestop[] = {{5, 0, 0, 15}, {5, 0, 0, 0}, {5, 0, 0, 15}, {5, 0, 0, 0}};
+	check_pattern("pokestop", pokestop, 4, LED_EVENT_POKESTOP);
+
+	const struct entry caught[] = {
+		{3, 8, 8, 8}, {9, 0, 0, 0}, {16, 0, 0, 0},
+		{3, 8, 8, 8}, {9, 0, 0, 0}, {16, 0, 0, 0},
+		{3, 8, 8, 8}, {9, 0, 0, 0}, {16, 0, 0, 0},
+		{5, 0, 15, 0}, {5, 0, 0, 15}, {5, 0, 15, 0}, {5, 0, 0, 15}};
+	check_pattern("caught", caught, 13, LED_EVENT_CAUGHT);
+
+	const struct entry fled[] = {
+		{3, 8, 8, 8}, {9, 0, 0, 0}, {16, 0, 0, 0},
+		{3, 8, 8, 8}, {9, 0, 0, 0}, {16, 0, 0, 0},
+		{5, 15, 0, 0}, {5, 0, 0, 0}, {5, 15, 0, 0}};
+	check_pattern("fled", fled, 9, LED_EVENT_FLED);
+
+	const struct entry items[] = {{5, 0, 15, 0}, {5, 15, 0, 0}, {5, 0, 0, 15}, {5, 0, 15, 0}, {5, 15, 0, 0}, {5, 0, 0, 15}};
+	check_pattern("items", items, 6, LED_EVENT_ITEMS);
+
+	const struct entry pink[] = {{5, 15, 0, 15}, {5, 0, 0, 0}};
+	check_pattern("pink", pink, 2, LED_EVENT_UNKNOWN);
+}
+
+static void test_random_patterns(int rounds)
+{
+	printf("--------------- %d random patterns against reference ------------\n", rounds);
+	uint8_t buffer[4 + 3 * 31];
+	struct entry entries[31];
+	led_pattern_t pattern;
+
+	srand(1);
+	for (int round = 0; round < rounds; round++)
+	{
+		int count = rand() % 32;
+		for (int i = 0; i < count; i++)
+		{
+			// mostly single colors and off so the interesting rules get hit
+			int color = rand() % 8;
+			entries[i].duration = rand() % 32;
+			entries[i].red = (color & 1) ? 1 + rand() % 15 : 0;
+			entries[i].green = (color & 2) ? 1 + rand() % 15 : 0;
+			entries[i].blue = (color & 4) ? 1 + rand() % 15 : 0;
+		}
+		int len = make_pattern(buffer, entries, count);
+		assert(led_pattern_parse(buffer, len, &pattern));
+		assert(led_pattern_classify(pattern.signature) == classify_reference(buffer));
+	}
+}
+
+static void test_truncated()
+{
+	printf("--------------- truncated writes ------------\n");
+	uint8_t buffer[4 + 3 * 31];
+	const struct entry pokemon[] = {{5, 0, 15, 0}, {5, 0, 0, 0}, {5, 0, 15, 0}, {5, 0, 0, 0}};
+	led_pattern_t pattern;
+
+	int len = make_pattern(buffer, pokemon, 4);
+	for (int cut = 0; cut < len; cut++)
+	{
+		assert(!led_pattern_parse(buffer, cut, &pattern));
+	}
+	assert(led_pattern_parse(buffer, len, &pattern));
+	// trailing bytes are fine
+	assert(led_pattern_parse(buffer, len + 3, &pattern));
+	assert(pattern.count == 4);
+
+	// header claims 31 entries, the write only has the header
+	buffer[3] = 31;
+	assert(!led_pattern_parse(buffer, 4, &pattern));
+}
+
+static void test_cache()
+{
+	printf("--------------- cache ------------\n");
+	static led_cache_t cache;
+	uint8_t buffer[4 + 3 * 31];
+	const struct entry pokemon[] = {{5, 0, 15, 0}, {5, 0, 0, 0}, {5, 0, 15, 0}, {5, 0, 0, 0}};
+	const struct entry pokestop[] = {{5, 0, 0, 15}, {5, 0, 0, 0}, {5, 0, 0, 15}, {5, 0, 0, 0}};
+	led_pattern_t pattern;
+	led_event_t event;
+
+	int len = make_pattern(buffer, pokemon, 4);
+	assert(led_pattern_classify_cached(&cache, buffer, len, &pattern, &event));
+	assert(event == LED_EVENT_POKEMON && cache.misses == 1 && cache.hits == 0);
+	assert(led_pattern_classify_cached(&cache, buffer, len, &pattern, &event));
+	assert(event == LED_EVENT_POKEMON && pattern.duration == 20 && cache.hits == 1);
+
+	len = make_pattern(buffer, pokestop, 4);
+	assert(led_pattern_classify_cached(&cache, buffer, len, &pattern, &event));
+	assert(event == LED_EVENT_POKESTOP && cache.misses == 2);
+
+	// malformed writes are never cached
+	buffer[3] = 31;
+	assert(!led_pattern_classify_cached(&cache, buffer, len, &pattern, &event));
+	assert(!led_pattern_classify_cached(&cache, buffer, len, &pattern, &event));
+	assert(cache.hits == 1);
+
+	// both patterns are still cached
+	len = make_pattern(buffer, pokemon, 4);
+	assert(led_pattern_classify_cached(&cache, buffer, len, &pattern, &event));
+	assert(event == LED_EVENT_POKEMON && cache.hits == 2 && cache.misses == 4);
+}
+
+static void test_rules()
+{
+	printf("--------------- rules ------------\n");
+	static led_action_t table[256];
+	const led_rule_t rules[] = {
+		// never press for anything green-only, with or without off entries
+		{LED_SIG_GREEN, LED_SIG_COLORS, {LED_ACTION_IGNORE, LED_FEEDBACK_SET, 0, 0}},
+		// but press blinking green with a custom delay
+		{LED_SIG_GREEN | LED_SIG_OFF, 0xff, {LED_ACTION_PRESS, LED_FEEDBACK_DEFAULT, 5, 10}},
+	};
+
+	led_rules_compile(rules, 0, table);
+	for (int sig = 0; sig < 256; sig++)
+	{
+		assert(table[sig].action == LED_ACTION_DEFAULT && table[sig].feedback == LED_FEEDBACK_DEFAULT);
+	}
+
+	led_rules_compile(rules, 2, table);
+	assert(table[LED_SIG_GREEN].action == LED_ACTION_IGNORE);
+	assert(table[LED_SIG_GREEN | LED_SIG_BALLSHAKE].action == LED_ACTION_IGNORE);
+	assert(table[LED_SIG_GREEN | LED_SIG_OFF].action == LED_ACTION_PRESS);
+	assert(table[LED_SIG_GREEN | LED_SIG_OFF].delay_min == 5);
+	assert(table[LED_SIG_GREEN | LED_SIG_BLUE].action == LED_ACTION_DEFAULT);
+	for (int sig = 0; sig < 256; sig++)
+	{
+		bool matches = (sig & LED_SIG_COLORS) == LED_SIG_GREEN;
+		assert((table[sig].action != LED_ACTION_DEFAULT) == matches);
+	}
+
+	led_rule_t rule = rules[0];
+	assert(led_rule_valid(&rule));
+	rule.then.action = LED_ACTIONS;
+	assert(!led_rule_valid(&rule));
+	rule = rules[1];
+	rule.then.delay_min = 20;
+	assert(!led_rule_valid(&rule));
+	rule.then.feedback = 0x40;
+	assert(!led_rule_valid(&rule));
+	// colors only count together with LED_FEEDBACK_SET
+	rule = rules[1];
+	rule.then.feedback = LED_FEEDBACK_RED;
+	assert(!led_rule_valid(&rule));
+	rule.then.feedback |= LED_FEEDBACK_SET;
+	assert(led_rule_valid(&rule));
+}
+
+static void benchmark(int rounds)
+{
+	printf("--------------- timing ------------\n");
+	uint8_t buffer[4 + 3 * 31];
+	struct entry entries[31];
+	for (int i = 0; i < 31; i++)
+	{
+		entries[i] = (struct entry){5, i & 1 ? 15 : 0, i & 2 ? 15 : 0, i & 4 ? 15 : 0};
+	}
+	int len = make_pattern(buffer, entries, 31);
+
+	led_pattern_t pattern;
+	volatile int sink = 0;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < rounds; i++)
+	{
+		led_pattern_parse(buffer, len, &pattern);
+		sink += led_pattern_classify(pattern.signature);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double table_ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / rounds;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < rounds; i++)
+	{
+		sink += classify_reference(buffer);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double reference_ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / rounds;
+
+	static led_cache_t cache;
+	led_event_t event;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < rounds; i++)
+	{
+		led_pattern_classify_cached(&cache, buffer, len, &pattern, &event);
+		sink += event;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double cached_ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / rounds;
+
+	printf("31 entry pattern: parse+table %.1f ns, cache hit %.1f ns, counting cascade %.1f ns\n",
+		   table_ns, cached_ns, reference_ns);
+}
+
+int main(int argc, char *argv[])
+{
+	init_led_patterns();
+
+	test_table();
+	test_known_patterns();
+	test_random_patterns(100000);
+	test_truncated();
+	test_cache();
+	test_rules();
+	benchmark(1000000);
+
+	printf("all led tests passed\n");
+	return 0;
+}
+
+#endif
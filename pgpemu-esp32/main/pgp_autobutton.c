@@ -1,3 +1,5 @@
+#include <stdatomic.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
@@ -7,13 +9,106 @@
 #include "esp_bt.h"
 #include "esp_gatts_api.h"
 #include "esp_random.h"
+#include "esp_timer.h"
 
 #include "pgp_autobutton.h"
 
+#include "gameplay_stats.h"
+#include "histogram.h"
 #include "log_tags.h"
+#include "pgp_conn_params.h"
 #include "pgp_gatts.h"
+#include "pgp_gatts_tx.h"
+#include "pgp_handshake_multi.h"
+
+// a press looks human between these delays after the led pattern started
+#define PRESS_DELAY_MIN_MS 1000
+#define PRESS_DELAY_MAX_MS 2500
+// short patterns may get a faster press, but never faster than this
+#define PRESS_DELAY_FLOOR_MS 300
+// kept free at the end of the pattern on top of the measured latencies
+#define PRESS_GUARD_MS 100
+
+// press delays are learned in buckets of this size, the last one takes everything longer
+#define PRESS_BUCKET_MS 250
+#define PRESS_BUCKETS 12
+// one in this many delays ignores the learned weights, so every bucket keeps being tried
+#define PRESS_EXPLORE 5
+// bucket statistics are halved at this many attempts so they follow changes
+#define PRESS_BUCKET_HISTORY 64
+// a bucket whose presses take this long to show an effect gets half the weight of an instant one.
+// also used for buckets without an accepted press yet.
+#define PRESS_LATENCY_REF_MS 1000
+// an outcome arriving later than this isn't linked to the press anymore
+static const int64_t PRESS_OUTCOME_TIMEOUT_US = 30 * 1000000LL;
+
+typedef struct
+{
+    atomic_uint requested;
+    atomic_uint scheduled;
+    // the default window had to start before PRESS_DELAY_MIN_MS
+    atomic_uint shortened;
+    // what the old fixed 1000-2500 ms delay would have dropped, for comparison
+    atomic_uint dropped_old_rule;
+    atomic_uint dropped_new_rule;
+    // pending presses dropped because their connection went away
+    atomic_uint cancelled;
+    // presses whose conn_id belongs to another session by now
+    atomic_uint misdirected;
+    // pending presses replaced by a newer one for the same connection
+    atomic_uint replaced;
+    // presses dropped because the queue or the pending list was full
+    atomic_uint overflows;
+    // presses the app reacted to (catch/spin animations etc.) or not (asked again)
+    atomic_uint accepted;
+    atomic_uint missed;
+    // no outcome within PRESS_OUTCOME_TIMEOUT_US or before the next press
+    atomic_uint no_outcome;
+} autobutton_stats_t;
+
+// only touched by the autobutton task
+typedef struct
+{
+    uint32_t attempts;
+    uint32_t accepted;
+    // moving average of press to outcome of accepted presses, 0 until the first one
+    uint32_t latency_ms;
+} press_bucket_t;
 
-QueueHandle_t button_queue;
+// last sent press of a session, waiting for the next led event. only touched by the autobutton task.
+typedef struct
+{
+    bool waiting;
+    uint16_t conn_id;
+    uint32_t generation;
+    uint8_t bucket;
+    // led_event_t the press was for
+    uint8_t trigger;
+    int64_t sent_at_us;
+} press_outcome_t;
+
+// only written through autobutton_schedule_press(), autobutton_cancel() and autobutton_led_event()
+static QueueHandle_t button_queue;
+
+static autobutton_stats_t autobutton_stats;
+// actual minus intended press time, only written by the autobutton task
+static histogram_t press_error = HISTOGRAM_INIT("press scheduling error", "us");
+// decaying peak of the scheduling error, like gatts_tx_latency_ms()
+static atomic_uint press_lateness_peak_ms = 0;
+
+// presses waiting for their time, each fires on its own so connections don't wait for each other.
+// at most one per connection, only touched by the autobutton task.
+#define PENDING_PRESSES CONFIG_BT_ACL_CONNECTIONS
+static button_queue_item_t pending[PENDING_PRESSES];
+static int pending_count = 0;
+
+static press_bucket_t buckets[PRESS_BUCKETS];
+static press_outcome_t outcomes[PENDING_PRESSES];
+static histogram_t outcome_latency = HISTOGRAM_INIT("press to outcome", "ms");
+// written by the autobutton task, read by autobutton_schedule_press() in the BTC task
+static atomic_uint bucket_weights[PRESS_BUCKETS];
+
+static void update_bucket_weights();
 
 static void autobutton_task(void *pvParameters);
 
@@ -25,57 +120,542 @@ bool init_autobutton()
         ESP_LOGE(BUTTON_TASK_TAG, "%s creating button queue failed", __func__);
         return false;
     }
+    update_bucket_weights();
 
     xTaskCreate(autobutton_task, "autobutton_task", 3072, NULL, 11, NULL);
 
     return true;
 }
 
+static int delay_bucket(int delay_ms)
+{
+    int bucket = delay_ms / PRESS_BUCKET_MS;
+    return bucket < PRESS_BUCKETS ? bucket : PRESS_BUCKETS - 1;
+}
+
+// part of [lo, hi] in bucket, false if there is none
+static bool bucket_range(int bucket, int lo, int hi, int *from, int *to)
+{
+    *from = bucket * PRESS_BUCKET_MS > lo ? bucket * PRESS_BUCKET_MS : lo;
+    *to = bucket == PRESS_BUCKETS - 1 ? hi : (bucket + 1) * PRESS_BUCKET_MS - 1;
+    *to = *to < hi ? *to : hi;
+    return *from <= *to;
+}
+
+// random delay in [lo, hi], buckets with a better record are picked more often
+static int pick_delay(int lo, int hi)
+{
+    uint32_t weights[PRESS_BUCKETS];
+    uint32_t total = 0;
+    int from, to;
+
+    for (int i = 0; i < PRESS_BUCKETS; i++)
+    {
+        weights[i] = 0;
+        if (bucket_range(i, lo, hi, &from, &to))
+        {
+            // partial buckets count less, equal weights give a uniform distribution. the last bucket
+            // is open ended, a long rule window must not make it outweigh everything learned.
+            int span = to - from + 1 < PRESS_BUCKET_MS ? to - from + 1 : PRESS_BUCKET_MS;
+            weights[i] = atomic_load(&bucket_weights[i]) * span / PRESS_BUCKET_MS + 1;
+        }
+        total += weights[i];
+    }
+
+    if (esp_random() % PRESS_EXPLORE == 0 || !total)
+    {
+        return lo + esp_random() % (hi - lo + 1);
+    }
+
+    uint32_t pick = esp_random() % total;
+    for (int i = 0; i < PRESS_BUCKETS; i++)
+    {
+        if (pick < weights[i])
+        {
+            bucket_range(i, lo, hi, &from, &to);
+            return from + esp_random() % (to - from + 1);
+        }
+        pick -= weights[i];
+    }
+    return hi;
+}
+
+bool autobutton_schedule_press(esp_gatt_if_t gatts_if, uint16_t conn_id, led_event_t event,
+                               int pattern_ms, int min_ms, int max_ms)
+{
+    atomic_fetch_add(&autobutton_stats.requested, 1);
+
+    int old_delay = PRESS_DELAY_MIN_MS + esp_random() % (PRESS_DELAY_MAX_MS - PRESS_DELAY_MIN_MS + 1);
+    if (old_delay >= pattern_ms)
+    {
+        atomic_fetch_add(&autobutton_stats.dropped_old_rule, 1);
+    }
+
+    // the press has to be sent and through the stack before the pattern ends
+    int tx_ms = gatts_tx_latency_ms();
+    int latest = pattern_ms - tx_ms - (int)atomic_load(&press_lateness_peak_ms) - PRESS_GUARD_MS;
+    if (latest < PRESS_DELAY_FLOOR_MS)
+    {
+        atomic_fetch_add(&autobutton_stats.dropped_new_rule, 1);
+        ESP_LOGW(BUTTON_TASK_TAG, "conn_id=%d pattern of %d ms is too short to press, latest=%d ms",
+                 conn_id, pattern_ms, latest);
+        return false;
+    }
+
+    // rules may ask for other delays, but not for faster than the floor
+    max_ms = max_ms ? max_ms : PRESS_DELAY_MAX_MS;
+    max_ms = max_ms > PRESS_DELAY_FLOOR_MS ? max_ms : PRESS_DELAY_FLOOR_MS;
+    int hi = latest < max_ms ? latest : max_ms;
+    int lo = min_ms ? min_ms : PRESS_DELAY_MIN_MS;
+    lo = lo > PRESS_DELAY_FLOOR_MS ? lo : PRESS_DELAY_FLOOR_MS;
+    if (hi < lo)
+    {
+        if (min_ms)
+        {
+            // pressing earlier than the rule asked for would break the rule
+            atomic_fetch_add(&autobutton_stats.dropped_new_rule, 1);
+            ESP_LOGW(BUTTON_TASK_TAG, "conn_id=%d rule delay of %d ms doesn't fit before %d ms, not pressing",
+                     conn_id, lo, hi);
+            return false;
+        }
+        // only the default window gets shortened
+        lo = hi / 2 > PRESS_DELAY_FLOOR_MS ? hi / 2 : PRESS_DELAY_FLOOR_MS;
+        atomic_fetch_add(&autobutton_stats.shortened, 1);
+    }
+    int delay = pick_delay(lo, hi);
+
+    client_state_t *entry = get_client_state_entry(conn_id);
+    if (!entry)
+    {
+        return false;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    button_queue_item_t item;
+    item.type = BUTTON_PRESS;
+    item.gatts_if = gatts_if;
+    item.conn_id = conn_id;
+    item.generation = entry->generation;
+    item.press_at_us = esp_timer_get_time() + delay * 1000LL;
+    // pressing after the led pattern ended is useless
+    item.deadline = now + pdMS_TO_TICKS(pattern_ms - tx_ms);
+    item.bucket = delay_bucket(delay);
+    item.event = event;
+
+    ESP_LOGD(BUTTON_TASK_TAG, "queueing press after %d ms (window %d-%d ms), conn_id=%d", delay, lo, hi, conn_id);
+    // never block the BT stack, the task drains the queue right away unless something is badly wrong
+    if (xQueueSend(button_queue, &item, 0) != pdTRUE)
+    {
+        atomic_fetch_add(&autobutton_stats.overflows, 1);
+        ESP_LOGW(BUTTON_TASK_TAG, "button queue full, dropping press for conn_id=%d", conn_id);
+        return false;
+    }
+    atomic_fetch_add(&autobutton_stats.scheduled, 1);
+
+    return true;
+}
+
+void autobutton_cancel(uint16_t conn_id)
+{
+    client_state_t *entry = get_client_state_entry(conn_id);
+    if (!entry)
+    {
+        return;
+    }
+
+    button_queue_item_t item = {
+        .type = BUTTON_CANCEL,
+        .conn_id = conn_id,
+        .generation = entry->generation,
+    };
+    // ahead of everything else. if the queue is full the presses are still caught by check_session().
+    if (xQueueSendToFront(button_queue, &item, 0) != pdTRUE)
+    {
+        atomic_fetch_add(&autobutton_stats.overflows, 1);
+    }
+}
+
+// the app reacted to a press
+static bool accepted_event(led_event_t event)
+{
+    switch (event)
+    {
+    case LED_EVENT_CAUGHT:
+    case LED_EVENT_FLED:
+    case LED_EVENT_SHAKE_UNKNOWN:
+    case LED_EVENT_ITEMS:
+    case LED_EVENT_BAG_FULL:
+    case LED_EVENT_BOX_FULL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// the app waits for a press
+static bool in_range_event(led_event_t event)
+{
+    return event == LED_EVENT_POKEMON || event == LED_EVENT_NEW_POKEMON || event == LED_EVENT_POKESTOP;
+}
+
+// 1 accepted, 0 missed, -1 if the event says nothing about a press for trigger
+static int press_outcome(led_event_t trigger, led_event_t event)
+{
+    if (accepted_event(event))
+    {
+        return 1;
+    }
+    // only the same prompt again means the app is still waiting for this press,
+    // e.g. a pokemon coming into range after a pokestop press says nothing about it
+    return in_range_event(event) && event == trigger ? 0 : -1;
+}
+
+void autobutton_led_event(uint16_t conn_id, led_event_t event)
+{
+    client_state_t *entry = get_client_state_entry(conn_id);
+    if (!(accepted_event(event) || in_range_event(event)) || !entry)
+    {
+        return;
+    }
+
+    button_queue_item_t item = {
+        .type = BUTTON_OUTCOME,
+        .conn_id = conn_id,
+        .generation = entry->generation,
+        .event = event,
+    };
+    // losing an outcome only costs one sample
+    xQueueSend(button_queue, &item, 0);
+}
+
+// success rate with a prior of 1/2, scaled down by how long accepted presses took to show an effect
+static void update_bucket_weights()
+{
+    for (int i = 0; i < PRESS_BUCKETS; i++)
+    {
+        uint32_t rate = 1000 * (buckets[i].accepted + 1) / (buckets[i].attempts + 2);
+        uint32_t latency_ms = buckets[i].latency_ms ? buckets[i].latency_ms : PRESS_LATENCY_REF_MS;
+        atomic_store(&bucket_weights[i], rate * PRESS_LATENCY_REF_MS / (PRESS_LATENCY_REF_MS + latency_ms));
+    }
+}
+
+static press_outcome_t *get_outcome(uint16_t conn_id, bool create)
+{
+    press_outcome_t *free_outcome = NULL;
+    for (int i = 0; i < PENDING_PRESSES; i++)
+    {
+        if (outcomes[i].waiting && outcomes[i].conn_id == conn_id)
+        {
+            return &outcomes[i];
+        }
+        if (!outcomes[i].waiting && !free_outcome)
+        {
+            free_outcome = &outcomes[i];
+        }
+    }
+    return create ? free_outcome : NULL;
+}
+
+static void expect_outcome(const button_queue_item_t *item)
+{
+    press_outcome_t *outcome = get_outcome(item->conn_id, true);
+    if (!outcome)
+    {
+        return;
+    }
+    if (outcome->waiting)
+    {
+        // pressed again before anything happened
+        atomic_fetch_add(&autobutton_stats.no_outcome, 1);
+    }
+    outcome->waiting = true;
+    outcome->conn_id = item->conn_id;
+    outcome->generation = item->generation;
+    outcome->bucket = item->bucket;
+    outcome->trigger = item->event;
+    outcome->sent_at_us = esp_timer_get_time();
+}
+
+static void handle_outcome(const button_queue_item_t *item)
+{
+    press_outcome_t *outcome = get_outcome(item->conn_id, false);
+    if (!outcome || outcome->generation != item->generation)
+    {
+        return;
+    }
+
+    int64_t latency_us = esp_timer_get_time() - outcome->sent_at_us;
+    if (latency_us > PRESS_OUTCOME_TIMEOUT_US)
+    {
+        outcome->waiting = false;
+        atomic_fetch_add(&autobutton_stats.no_outcome, 1);
+        return;
+    }
+    int result = press_outcome(outcome->trigger, item->event);
+    if (result < 0)
+    {
+        // unrelated prompt, keep waiting
+        return;
+    }
+    outcome->waiting = false;
+    histogram_add(&outcome_latency, latency_us / 1000);
+
+    bool accepted = result > 0;
+    press_bucket_t *bucket = &buckets[outcome->bucket < PRESS_BUCKETS ? outcome->bucket : 0];
+    if (bucket->attempts >= PRESS_BUCKET_HISTORY)
+    {
+        bucket->attempts /= 2;
+        bucket->accepted /= 2;
+    }
+    bucket->attempts++;
+    bucket->accepted += accepted;
+    if (accepted)
+    {
+        // +1 so a very fast outcome doesn't look like no sample
+        uint32_t latency_ms = latency_us / 1000 + 1;
+        if (!bucket->latency_ms)
+        {
+            bucket->latency_ms = latency_ms;
+        }
+        else
+        {
+            bucket->latency_ms = (7 * bucket->latency_ms + latency_ms) / 8;
+        }
+    }
+    update_bucket_weights();
+
+    atomic_fetch_add(accepted ? &autobutton_stats.accepted : &autobutton_stats.missed, 1);
+    gameplay_stats_press_outcome(accepted);
+    ESP_LOGD(BUTTON_TASK_TAG, "conn_id=%d press %s after %lld ms (%s)", item->conn_id,
+             accepted ? "accepted" : "missed", latency_us / 1000, led_event_names[item->event]);
+}
+
+// scheduling error of a press that fired at now_us
+static void record_error(int64_t press_at_us, int64_t now_us)
+{
+    uint32_t us = now_us > press_at_us ? now_us - press_at_us : 0;
+    histogram_add(&press_error, us);
+
+    unsigned int ms = (us + 999) / 1000;
+    unsigned int peak = atomic_load(&press_lateness_peak_ms);
+    if (ms > peak)
+    {
+        peak = (peak + ms + 1) / 2;
+    }
+    else
+    {
+        peak -= (peak - ms) / 16;
+    }
+    atomic_store(&press_lateness_peak_ms, peak);
+}
+
+// false (and counted) if the session of item is gone
+static bool check_session(const button_queue_item_t *item, client_state_t *snapshot)
+{
+    if (!get_client_state_snapshot_by_conn_id(item->conn_id, snapshot))
+    {
+        ESP_LOGW(BUTTON_TASK_TAG, "conn_id=%d disconnected, dropping press", item->conn_id);
+        atomic_fetch_add(&autobutton_stats.cancelled, 1);
+        return false;
+    }
+    if (snapshot->generation != item->generation)
+    {
+        ESP_LOGW(BUTTON_TASK_TAG, "conn_id=%d is another session now (%lu, press was for %lu), dropping press",
+                 item->conn_id, snapshot->generation, item->generation);
+        atomic_fetch_add(&autobutton_stats.misdirected, 1);
+        return false;
+    }
+    return true;
+}
+
+static void send_press(const button_queue_item_t *item)
+{
+    // static to keep it off the task stack
+    static client_state_t snapshot;
+
+    // according to u/EeveesGalore's docs (https://i.imgur.com/7oWjMNu.png) button is sampled every 50 ms
+    // byte 0 = samples0,1 (2=LSBit)
+    // byte 1 = samples2-9 (10=LSBit)
+    // randomize at which sample the button press starts and ends (min. diff 200 ms)
+    int press_start = esp_random() % 6; // start at sample 0-5
+    int press_last = press_start + 4 + esp_random() % (10 - press_start - 4);
+    //               ^--min value--^                  ^-min distance to 10-^
+    int press_duration = press_last - press_start + 1;
+
+    // set bits where the button is pressed
+    uint16_t button_pattern = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        button_pattern <<= 1; // this gets shifted 10 times total
+        if (i >= press_start && i <= press_last)
+        {
+            button_pattern |= 1; // button is pressed
+        }
+    }
+    button_pattern &= 0x03ff; // just to be safe
+
+    // make little endian byte array for sending
+    uint8_t notify_data[2] = {
+        (button_pattern >> 8) & 0x03,
+        button_pattern & 0xff};
+
+    // the client may have disconnected or unsubscribed while we waited
+    if (!check_session(item, &snapshot))
+    {
+        return;
+    }
+    if (!client_subscribed(&snapshot, SUBSCRIPTION_BUTTON))
+    {
+        ESP_LOGW(BUTTON_TASK_TAG, "conn_id=%d not subscribed anymore, dropping press", item->conn_id);
+        count_prevented_send(SUBSCRIPTION_BUTTON);
+        return;
+    }
+
+    ESP_LOGI(BUTTON_TASK_TAG, "pressing button, duration=%d ms, conn_id=%d", press_duration * 50, item->conn_id);
+    if (gatts_tx_send(item->gatts_if,
+                      item->conn_id,
+                      item->generation,
+                      led_button_handle_table[IDX_CHAR_BUTTON_VAL],
+                      notify_data, sizeof(notify_data), item->deadline))
+    {
+        expect_outcome(item);
+    }
+    conn_params_activity(item->conn_id);
+}
+
+// fire all due presses, returns how long to sleep until the next one
+static TickType_t run_due_presses()
+{
+    int64_t now_us = esp_timer_get_time();
+    int64_t next_us = INT64_MAX;
+
+    for (int i = 0; i < pending_count;)
+    {
+        if (pending[i].press_at_us <= now_us)
+        {
+            record_error(pending[i].press_at_us, now_us);
+            send_press(&pending[i]);
+            pending[i] = pending[--pending_count];
+            // sending took a moment
+            now_us = esp_timer_get_time();
+            continue;
+        }
+        next_us = pending[i].press_at_us < next_us ? pending[i].press_at_us : next_us;
+        i++;
+    }
+
+    if (next_us == INT64_MAX)
+    {
+        return portMAX_DELAY;
+    }
+    // round up, waking up early would just mean another round
+    const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+    return (next_us - now_us + tick_us - 1) / tick_us;
+}
+
+static void cancel_presses(uint16_t conn_id, uint32_t generation)
+{
+    for (int i = 0; i < pending_count;)
+    {
+        if (pending[i].conn_id == conn_id && pending[i].generation == generation)
+        {
+            atomic_fetch_add(&autobutton_stats.cancelled, 1);
+            pending[i] = pending[--pending_count];
+            continue;
+        }
+        i++;
+    }
+
+    press_outcome_t *outcome = get_outcome(conn_id, false);
+    if (outcome && outcome->generation == generation)
+    {
+        outcome->waiting = false;
+    }
+}
+
+// newer presses replace older ones of the same connection
+static void add_press(const button_queue_item_t *item)
+{
+    for (int i = 0; i < pending_count; i++)
+    {
+        if (pending[i].conn_id == item->conn_id)
+        {
+            ESP_LOGD(BUTTON_TASK_TAG, "conn_id=%d replacing pending press", item->conn_id);
+            atomic_fetch_add(&autobutton_stats.replaced, 1);
+            pending[i] = *item;
+            return;
+        }
+    }
+
+    if (pending_count >= PENDING_PRESSES)
+    {
+        // only possible with stale conn_ids
+        atomic_fetch_add(&autobutton_stats.overflows, 1);
+        ESP_LOGW(BUTTON_TASK_TAG, "too many pending presses, dropping press for conn_id=%d", item->conn_id);
+        return;
+    }
+    pending[pending_count++] = *item;
+}
+
 static void autobutton_task(void *pvParameters)
 {
     button_queue_item_t item;
+    // static to keep it off the task stack
+    static client_state_t snapshot;
 
     ESP_LOGI(BUTTON_TASK_TAG, "task start");
 
     while (1)
     {
-        if (xQueueReceive(button_queue, &item, portMAX_DELAY))
+        TickType_t wait = run_due_presses();
+        if (xQueueReceive(button_queue, &item, wait))
         {
-            // according to u/EeveesGalore's docs (https://i.imgur.com/7oWjMNu.png) button is sampled every 50 ms
-            // byte 0 = samples0,1 (2=LSBit)
-            // byte 1 = samples2-9 (10=LSBit)
-            // randomize at which sample the button press starts and ends (min. diff 200 ms)
-            int press_start = esp_random() % 6; // start at sample 0-5
-            int press_last = press_start + 4 + esp_random() % (10 - press_start - 4);
-            //               ^--min value--^                  ^-min distance to 10-^
-            int press_duration = press_last - press_start + 1;
-
-            // set bits where the button is pressed
-            uint16_t button_pattern = 0;
-            for (int i = 0; i < 10; i++)
+            if (item.type == BUTTON_CANCEL)
             {
-                button_pattern <<= 1; // this gets shifted 10 times total
-                if (i >= press_start && i <= press_last)
-                {
-                    button_pattern |= 1; // button is pressed
-                }
+                cancel_presses(item.conn_id, item.generation);
             }
-            button_pattern &= 0x03ff; // just to be safe
+            else if (item.type == BUTTON_OUTCOME)
+            {
+                handle_outcome(&item);
+            }
+            else if (check_session(&item, &snapshot))
+            {
+                add_press(&item);
+            }
+        }
+    }
 
-            // make little endian byte array for sending
-            uint8_t notify_data[2] = {
-                (button_pattern >> 8) & 0x03,
-                button_pattern & 0xff};
+    vTaskDelete(NULL);
+}
 
-            ESP_LOGI(BUTTON_TASK_TAG, "pressing button delay=%d ms, duration=%d ms, conn_id=%d", item.delay, press_duration * 50, item.conn_id);
-            vTaskDelay(item.delay / portTICK_PERIOD_MS);
+void dump_autobutton_stats()
+{
+    ESP_LOGI(BUTTON_TASK_TAG, "presses: requested=%u, scheduled=%u, shortened=%u",
+             atomic_load(&autobutton_stats.requested), atomic_load(&autobutton_stats.scheduled),
+             atomic_load(&autobutton_stats.shortened));
+    ESP_LOGI(BUTTON_TASK_TAG, "too short to press: %u (old fixed delay would drop %u)",
+             atomic_load(&autobutton_stats.dropped_new_rule), atomic_load(&autobutton_stats.dropped_old_rule));
+    ESP_LOGI(BUTTON_TASK_TAG, "cancelled on disconnect: %u, misdirected: %u, replaced: %u, overflows: %u",
+             atomic_load(&autobutton_stats.cancelled), atomic_load(&autobutton_stats.misdirected),
+             atomic_load(&autobutton_stats.replaced), atomic_load(&autobutton_stats.overflows));
+    histogram_dump(BUTTON_TASK_TAG, &press_error);
+    ESP_LOGI(BUTTON_TASK_TAG, "lateness estimate: %u ms", atomic_load(&press_lateness_peak_ms));
 
-            esp_ble_gatts_send_indicate(item.gatts_if,
-                                        item.conn_id,
-                                        led_button_handle_table[IDX_CHAR_BUTTON_VAL],
-                                        sizeof(notify_data), notify_data, false);
+    unsigned int accepted = atomic_load(&autobutton_stats.accepted);
+    unsigned int missed = atomic_load(&autobutton_stats.missed);
+    ESP_LOGI(BUTTON_TASK_TAG, "outcomes: accepted=%u, missed=%u (%u%%), unknown=%u", accepted, missed,
+             accepted + missed ? 100 * accepted / (accepted + missed) : 0, atomic_load(&autobutton_stats.no_outcome));
+    histogram_dump(BUTTON_TASK_TAG, &outcome_latency);
+    ESP_LOGI(BUTTON_TASK_TAG, "delay buckets (recent accepted/attempts, average latency, weight):");
+    for (int i = 0; i < PRESS_BUCKETS; i++)
+    {
+        // racy read of the task's counters, fine for display
+        press_bucket_t bucket = buckets[i];
+        if (bucket.attempts)
+        {
+            ESP_LOGI(BUTTON_TASK_TAG, "- %d-%d ms: %lu/%lu, %lu ms, %u", i * PRESS_BUCKET_MS,
+                     i == PRESS_BUCKETS - 1 ? 99999 : (i + 1) * PRESS_BUCKET_MS - 1,
+                     bucket.accepted, bucket.attempts, bucket.latency_ms, atomic_load(&bucket_weights[i]));
         }
     }
-
-    vTaskDelete(NULL);
 }
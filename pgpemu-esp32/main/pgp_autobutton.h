@@ -1,22 +1,59 @@
 #ifndef PGP_AUTOBUTTON_H
 #define PGP_AUTOBUTTON_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "esp_gatt_defs.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+
+#include "pgp_led_pattern.h"
+
+typedef enum
+{
+    BUTTON_PRESS,
+    // drop pending presses of conn_id/generation
+    BUTTON_CANCEL,
+    // led event which tells if the last press of conn_id/generation was accepted
+    BUTTON_OUTCOME,
+} button_queue_item_type_t;
 
 typedef struct
 {
-    // which session does this belong to
+    button_queue_item_type_t type;
+
+    // which session does this belong to, conn_ids are reused but generations aren't
     esp_gatt_if_t gatts_if;
     uint16_t conn_id;
+    uint32_t generation;
 
-    // delay after which button is pressed
-    int delay;
-} button_queue_item_t;
+    // esp_timer_get_time() at which the button is pressed
+    int64_t press_at_us;
+    // the press is dropped if it can't be sent before this tick (0 for no deadline)
+    TickType_t deadline;
+    // delay bucket the press was picked from
+    uint8_t bucket;
 
-extern QueueHandle_t button_queue;
+    // led_event_t of BUTTON_OUTCOME, or the one which caused a BUTTON_PRESS
+    uint8_t event;
+} button_queue_item_t;
 
 bool init_autobutton();
 
+// BTC task: pick a random press time between min_ms and max_ms (0 for the defaults) which still
+// reaches the app before a led pattern of pattern_ms ends and queue the press. event is what the
+// pattern was classified as. returns false if there is no such time.
+bool autobutton_schedule_press(esp_gatt_if_t gatts_if, uint16_t conn_id, led_event_t event,
+                               int pattern_ms, int min_ms, int max_ms);
+
+// BTC task: on disconnect, before the client state of conn_id is deleted
+void autobutton_cancel(uint16_t conn_id);
+
+// BTC task: every classified led event, before a press for it is scheduled.
+// a result animation after a press means the app accepted it, the prompt the press was for
+// repeating means it didn't. the delays are tuned by that.
+void autobutton_led_event(uint16_t conn_id, led_event_t event);
+
+void dump_autobutton_stats();
+
 #endif /* PGP_AUTOBUTTON_H */
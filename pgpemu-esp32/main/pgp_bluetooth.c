@@ -12,6 +12,7 @@
 #include "pgp_bluetooth.h"
 
 #include "log_tags.h"
+#include "pgp_conn_events.h"
 #include "pgp_gap.h"
 #include "pgp_gatts.h"
 #include "pgp_handshake_multi.h"
@@ -26,7 +27,8 @@ uint8_t bt_mac[6];
 bool init_bluetooth()
 {
     init_handshake_multi();
-    
+    conn_events_subscribe(gap_conn_event_handler);
+
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 
     // set mac address for pgp clone device
@@ -0,0 +1,135 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "pgp_conn_events.h"
+
+#include "log_tags.h"
+#include "pgp_handshake_multi.h"
+
+#define MAX_SUBSCRIBERS 8
+// must be a power of 2
+#define RING_SIZE 16
+
+static conn_event_handler_t subscribers[MAX_SUBSCRIBERS];
+static int subscriber_count = 0;
+
+// single producer (BTC task), single consumer (conn_events task) ring
+static conn_event_t ring[RING_SIZE];
+static atomic_uint ring_head = 0; // next write, only advanced by producer
+static atomic_uint ring_tail = 0; // next read, only advanced by consumer
+static atomic_uint dropped_events = 0;
+
+static TaskHandle_t conn_events_task_handle = NULL;
+
+static void conn_events_task(void *pvParameters);
+
+void init_conn_events()
+{
+    xTaskCreate(conn_events_task, "conn_events", 3072, NULL, 13, &conn_events_task_handle);
+}
+
+bool conn_events_subscribe(conn_event_handler_t handler)
+{
+    if (!handler || subscriber_count >= MAX_SUBSCRIBERS)
+    {
+        ESP_LOGE(CONN_EVENTS_TAG, "can't add subscriber");
+        return false;
+    }
+
+    subscribers[subscriber_count++] = handler;
+    return true;
+}
+
+void conn_events_publish(conn_event_type_t type, uint16_t conn_id, int reason, const uint8_t *bda)
+{
+    unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (head - tail >= RING_SIZE)
+    {
+        atomic_fetch_add(&dropped_events, 1);
+        return;
+    }
+
+    conn_event_t *event = &ring[head % RING_SIZE];
+    event->type = type;
+    event->conn_id = conn_id;
+    event->reason = reason;
+    event->active_connections = get_active_connections();
+    if (bda)
+    {
+        memcpy(event->bda, bda, sizeof(esp_bd_addr_t));
+    }
+    else
+    {
+        memset(event->bda, 0, sizeof(esp_bd_addr_t));
+    }
+    event->timestamp = xTaskGetTickCount();
+
+    atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+
+    if (conn_events_task_handle)
+    {
+        xTaskNotifyGive(conn_events_task_handle);
+    }
+}
+
+const char *conn_event_name(conn_event_type_t type)
+{
+    switch (type)
+    {
+    case CONN_EVENT_CONNECTED:
+        return "connected";
+    case CONN_EVENT_ENCRYPTED:
+        return "encrypted";
+    case CONN_EVENT_HANDSHAKE_COMPLETE:
+        return "handshake complete";
+    case CONN_EVENT_RESUMED:
+        return "resumed";
+    case CONN_EVENT_DISCONNECTED:
+        return "disconnected";
+    default:
+        return "?";
+    }
+}
+
+static void conn_events_task(void *pvParameters)
+{
+    conn_event_t event;
+    unsigned int reported_drops = 0;
+
+    ESP_LOGI(CONN_EVENTS_TAG, "task start");
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&ring_head, memory_order_acquire))
+        {
+            memcpy(&event, &ring[tail % RING_SIZE], sizeof(event));
+            tail++;
+            atomic_store_explicit(&ring_tail, tail, memory_order_release);
+
+            ESP_LOGD(CONN_EVENTS_TAG, "%s: conn_id=%d, reason=%d, active_connections=%d",
+                     conn_event_name(event.type), event.conn_id, event.reason, event.active_connections);
+
+            for (int i = 0; i < subscriber_count; i++)
+            {
+                subscribers[i](&event);
+            }
+        }
+
+        unsigned int drops = atomic_load(&dropped_events);
+        if (drops != reported_drops)
+        {
+            ESP_LOGE(CONN_EVENTS_TAG, "ring overflow, %u events dropped in total", drops);
+            reported_drops = drops;
+        }
+    }
+
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,45 @@
+#ifndef PGP_CONN_EVENTS_H
+#define PGP_CONN_EVENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_bt_defs.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum
+{
+    CONN_EVENT_CONNECTED,
+    CONN_EVENT_ENCRYPTED,
+    CONN_EVENT_HANDSHAKE_COMPLETE,
+    CONN_EVENT_RESUMED,
+    CONN_EVENT_DISCONNECTED,
+} conn_event_type_t;
+
+typedef struct
+{
+    conn_event_type_t type;
+    // 0xffff if not known (encrypted event for an unknown address)
+    uint16_t conn_id;
+    // disconnect reason, auth failure reason for failed encryption, otherwise 0
+    int reason;
+    // established connections right after this event happened
+    int active_connections;
+    esp_bd_addr_t bda;
+    TickType_t timestamp;
+} conn_event_t;
+
+// subscribers run in the conn_events task, not in the BT callback
+typedef void (*conn_event_handler_t)(const conn_event_t *event);
+
+void init_conn_events();
+
+// only call this during init before bluetooth is started
+bool conn_events_subscribe(conn_event_handler_t handler);
+
+// never blocks. only call from the BTC task (GATTS/GAP callbacks), it's the only producer.
+void conn_events_publish(conn_event_type_t type, uint16_t conn_id, int reason, const uint8_t *bda);
+
+const char *conn_event_name(conn_event_type_t type);
+
+#endif /* PGP_CONN_EVENTS_H */
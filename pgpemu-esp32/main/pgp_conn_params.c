@@ -0,0 +1,450 @@
+#include <string.h>
+
+#include "esp_gap_ble_api.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "pgp_conn_params.h"
+
+#include "log_tags.h"
+#include "pgp_conn_events.h"
+
+#define MAX_CONNECTIONS CONFIG_BT_ACL_CONNECTIONS
+// phones we remember overrides for (until reboot)
+#define MAX_OVERRIDES 8
+
+// no LED/button traffic for this long switches a connection to the idle profile
+static const TickType_t IDLE_AFTER = pdMS_TO_TICKS(15000);
+// don't ask for new parameters more often than this (except to get fast again)
+static const TickType_t MIN_REQUEST_SPACING = pdMS_TO_TICKS(5000);
+// how often idle timeouts are checked
+static const TickType_t POLICY_TICK = pdMS_TO_TICKS(1000);
+
+typedef enum
+{
+    CONN_PROFILE_NONE,
+    CONN_PROFILE_FAST,
+    CONN_PROFILE_IDLE,
+    CONN_PROFILE_IDLE_MILD,
+    CONN_PROFILES,
+} conn_profile_t;
+
+typedef struct
+{
+    const char *name;
+    // intervals in 1.25 ms units, timeout in 10 ms units
+    uint16_t min_int, max_int, latency, timeout;
+} conn_profile_params_t;
+
+// all of them stay within Apple's accessory design guidelines
+static const conn_profile_params_t profiles[CONN_PROFILES] = {
+    [CONN_PROFILE_NONE] = {"none", 0, 0, 0, 0},
+    // 20-40 ms, what we always used
+    [CONN_PROFILE_FAST] = {"fast", 0x10, 0x20, 0, 400},
+    // 90-120 ms, skip up to 4 events: 600 ms worst case until we listen
+    [CONN_PROFILE_IDLE] = {"idle", 0x48, 0x60, 4, 600},
+    // for phones rejecting the above
+    [CONN_PROFILE_IDLE_MILD] = {"idle mild", 0x30, 0x48, 1, 500},
+};
+
+typedef enum
+{
+    CONN_PARAMS_MSG_CONNECTED,
+    CONN_PARAMS_MSG_READY,
+    CONN_PARAMS_MSG_DISCONNECTED,
+    CONN_PARAMS_MSG_ACTIVITY,
+    CONN_PARAMS_MSG_UPDATED,
+    CONN_PARAMS_MSG_DUMP,
+} conn_params_msg_type_t;
+
+typedef struct
+{
+    conn_params_msg_type_t type;
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    int status;
+    uint16_t conn_int, latency, timeout;
+} conn_params_msg_t;
+
+// everything below is only touched by the conn_params task
+typedef struct
+{
+    bool in_use;
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    // handshake done, before that we always stay fast
+    bool ready;
+    conn_profile_t requested;
+    TickType_t requested_at;
+    TickType_t last_activity;
+
+    // what the central actually uses, conn_int 0 while unknown
+    uint16_t conn_int, latency, timeout;
+    TickType_t params_since;
+} conn_slot_t;
+
+typedef struct
+{
+    bool in_use;
+    esp_bd_addr_t bda;
+    uint8_t idle_rejects;
+    TickType_t last_seen;
+} conn_override_t;
+
+static QueueHandle_t conn_params_queue = NULL;
+static conn_slot_t slots[MAX_CONNECTIONS];
+static conn_override_t overrides[MAX_OVERRIDES];
+
+// connection events (x1000) the radio had to serve, and how many it would have been at the fast interval
+static uint64_t radio_events_milli = 0, baseline_events_milli = 0;
+static uint32_t requests = 0, rejects = 0;
+
+static void conn_params_task(void *pvParameters);
+static void conn_params_conn_event_handler(const conn_event_t *event);
+
+bool init_conn_params()
+{
+    conn_params_queue = xQueueCreate(16, sizeof(conn_params_msg_t));
+    if (!conn_params_queue)
+    {
+        ESP_LOGE(CONN_PARAMS_TAG, "%s creating queue failed", __func__);
+        return false;
+    }
+
+    if (!conn_events_subscribe(conn_params_conn_event_handler))
+    {
+        return false;
+    }
+
+    xTaskCreate(conn_params_task, "conn_params", 3072, NULL, 6, NULL);
+
+    return true;
+}
+
+static void post_msg(const conn_params_msg_t *msg)
+{
+    if (!conn_params_queue || xQueueSend(conn_params_queue, msg, 0) != pdTRUE)
+    {
+        ESP_LOGW(CONN_PARAMS_TAG, "queue full, lost message %d", msg->type);
+    }
+}
+
+static void conn_params_conn_event_handler(const conn_event_t *event)
+{
+    conn_params_msg_t msg = {0};
+    switch (event->type)
+    {
+    case CONN_EVENT_CONNECTED:
+        msg.type = CONN_PARAMS_MSG_CONNECTED;
+        break;
+    case CONN_EVENT_HANDSHAKE_COMPLETE:
+    case CONN_EVENT_RESUMED:
+        msg.type = CONN_PARAMS_MSG_READY;
+        break;
+    case CONN_EVENT_DISCONNECTED:
+        msg.type = CONN_PARAMS_MSG_DISCONNECTED;
+        break;
+    default:
+        return;
+    }
+    msg.conn_id = event->conn_id;
+    memcpy(msg.bda, event->bda, sizeof(esp_bd_addr_t));
+    post_msg(&msg);
+}
+
+void conn_params_activity(uint16_t conn_id)
+{
+    conn_params_msg_t msg = {
+        .type = CONN_PARAMS_MSG_ACTIVITY,
+        .conn_id = conn_id,
+    };
+    post_msg(&msg);
+}
+
+void conn_params_updated(const uint8_t *bda, int status, uint16_t conn_int, uint16_t latency, uint16_t timeout)
+{
+    conn_params_msg_t msg = {
+        .type = CONN_PARAMS_MSG_UPDATED,
+        .status = status,
+        .conn_int = conn_int,
+        .latency = latency,
+        .timeout = timeout,
+    };
+    memcpy(msg.bda, bda, sizeof(esp_bd_addr_t));
+    post_msg(&msg);
+}
+
+void conn_params_dump()
+{
+    conn_params_msg_t msg = {
+        .type = CONN_PARAMS_MSG_DUMP,
+    };
+    post_msg(&msg);
+}
+
+static conn_slot_t *get_slot(uint16_t conn_id)
+{
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        if (slots[i].in_use && slots[i].conn_id == conn_id)
+        {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static conn_slot_t *get_slot_by_bda(const uint8_t *bda)
+{
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        if (slots[i].in_use && memcmp(slots[i].bda, bda, sizeof(esp_bd_addr_t)) == 0)
+        {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static conn_override_t *get_override(const uint8_t *bda, bool create)
+{
+    conn_override_t *oldest = &overrides[0];
+    for (int i = 0; i < MAX_OVERRIDES; i++)
+    {
+        if (overrides[i].in_use && memcmp(overrides[i].bda, bda, sizeof(esp_bd_addr_t)) == 0)
+        {
+            return &overrides[i];
+        }
+        if (!overrides[i].in_use || (oldest->in_use && overrides[i].last_seen < oldest->last_seen))
+        {
+            oldest = &overrides[i];
+        }
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    // replace the least recently seen phone
+    memset(oldest, 0, sizeof(conn_override_t));
+    oldest->in_use = true;
+    memcpy(oldest->bda, bda, sizeof(esp_bd_addr_t));
+    return oldest;
+}
+
+// idle profile for this phone, or fast if it rejected everything
+static conn_profile_t idle_profile_for(const uint8_t *bda)
+{
+    conn_override_t *override = get_override(bda, false);
+    if (!override || override->idle_rejects == 0)
+    {
+        return CONN_PROFILE_IDLE;
+    }
+    if (override->idle_rejects == 1)
+    {
+        return CONN_PROFILE_IDLE_MILD;
+    }
+    return CONN_PROFILE_FAST;
+}
+
+// add the connection events since the last parameter change to the duty cycle estimate
+static void account_radio_time(conn_slot_t *slot, TickType_t now)
+{
+    if (slot->conn_int && slot->params_since)
+    {
+        uint64_t elapsed_ms = pdTICKS_TO_MS(now - slot->params_since);
+        // conn_int is in 1.25 ms units, the peripheral listens every (latency + 1)th event
+        radio_events_milli += elapsed_ms * 1000 * 4 / (slot->conn_int * 5 * (slot->latency + 1));
+        baseline_events_milli += elapsed_ms * 1000 * 4 / (profiles[CONN_PROFILE_FAST].max_int * 5);
+    }
+    slot->params_since = now;
+}
+
+static void request_profile(conn_slot_t *slot, conn_profile_t profile, TickType_t now)
+{
+    const conn_profile_params_t *params = &profiles[profile];
+
+    esp_ble_conn_update_params_t conn_params = {
+        .min_int = params->min_int,
+        .max_int = params->max_int,
+        .latency = params->latency,
+        .timeout = params->timeout,
+    };
+    memcpy(conn_params.bda, slot->bda, sizeof(esp_bd_addr_t));
+
+    esp_err_t err = esp_ble_gap_update_conn_params(&conn_params);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(CONN_PARAMS_TAG, "conn_id=%d requesting %s params failed: %d", slot->conn_id, params->name, err);
+        return;
+    }
+
+    ESP_LOGI(CONN_PARAMS_TAG, "conn_id=%d requesting %s params", slot->conn_id, params->name);
+    slot->requested = profile;
+    slot->requested_at = now;
+    requests++;
+}
+
+static void handle_updated(const conn_params_msg_t *msg, TickType_t now)
+{
+    conn_slot_t *slot = get_slot_by_bda(msg->bda);
+    if (!slot)
+    {
+        return;
+    }
+
+    if (msg->status != ESP_BT_STATUS_SUCCESS)
+    {
+        rejects++;
+        ESP_LOGW(CONN_PARAMS_TAG, "conn_id=%d phone rejected %s params, status=%d",
+                 slot->conn_id, profiles[slot->requested].name, msg->status);
+        if (slot->requested == CONN_PROFILE_IDLE || slot->requested == CONN_PROFILE_IDLE_MILD)
+        {
+            conn_override_t *override = get_override(slot->bda, true);
+            override->idle_rejects++;
+            override->last_seen = now;
+        }
+        return;
+    }
+
+    account_radio_time(slot, now);
+    slot->conn_int = msg->conn_int;
+    slot->latency = msg->latency;
+    slot->timeout = msg->timeout;
+}
+
+static void handle_msg(const conn_params_msg_t *msg, TickType_t now)
+{
+    conn_slot_t *slot;
+    switch (msg->type)
+    {
+    case CONN_PARAMS_MSG_CONNECTED:
+        slot = get_slot(msg->conn_id);
+        for (int i = 0; !slot && i < MAX_CONNECTIONS; i++)
+        {
+            if (!slots[i].in_use)
+            {
+                slot = &slots[i];
+            }
+        }
+        if (!slot)
+        {
+            ESP_LOGE(CONN_PARAMS_TAG, "no free slot for conn_id=%d", msg->conn_id);
+            break;
+        }
+        memset(slot, 0, sizeof(conn_slot_t));
+        slot->in_use = true;
+        slot->conn_id = msg->conn_id;
+        memcpy(slot->bda, msg->bda, sizeof(esp_bd_addr_t));
+        slot->last_activity = now;
+
+        conn_override_t *override = get_override(slot->bda, false);
+        if (override)
+        {
+            override->last_seen = now;
+        }
+
+        // the handshake needs many round trips
+        request_profile(slot, CONN_PROFILE_FAST, now);
+        break;
+    case CONN_PARAMS_MSG_READY:
+        slot = get_slot(msg->conn_id);
+        if (slot)
+        {
+            slot->ready = true;
+            slot->last_activity = now;
+        }
+        break;
+    case CONN_PARAMS_MSG_DISCONNECTED:
+        slot = get_slot(msg->conn_id);
+        if (slot)
+        {
+            account_radio_time(slot, now);
+            slot->in_use = false;
+        }
+        break;
+    case CONN_PARAMS_MSG_ACTIVITY:
+        slot = get_slot(msg->conn_id);
+        if (slot)
+        {
+            slot->last_activity = now;
+            if (slot->requested != CONN_PROFILE_FAST)
+            {
+                request_profile(slot, CONN_PROFILE_FAST, now);
+            }
+        }
+        break;
+    case CONN_PARAMS_MSG_UPDATED:
+        handle_updated(msg, now);
+        break;
+    case CONN_PARAMS_MSG_DUMP:
+        for (int i = 0; i < MAX_CONNECTIONS; i++)
+        {
+            if (slots[i].in_use)
+            {
+                account_radio_time(&slots[i], now);
+                ESP_LOGI(CONN_PARAMS_TAG, "conn_id=%d: requested=%s, interval=%d.%02d ms, latency=%d, timeout=%d ms, idle for %lu s",
+                         slots[i].conn_id, profiles[slots[i].requested].name,
+                         slots[i].conn_int * 125 / 100, slots[i].conn_int * 125 % 100,
+                         slots[i].latency, slots[i].timeout * 10,
+                         pdTICKS_TO_MS(now - slots[i].last_activity) / 1000);
+            }
+        }
+        for (int i = 0; i < MAX_OVERRIDES; i++)
+        {
+            if (overrides[i].in_use)
+            {
+                ESP_LOGI(CONN_PARAMS_TAG, "override %02x:%02x:%02x:%02x:%02x:%02x: %d rejects -> %s",
+                         overrides[i].bda[0], overrides[i].bda[1], overrides[i].bda[2],
+                         overrides[i].bda[3], overrides[i].bda[4], overrides[i].bda[5],
+                         overrides[i].idle_rejects, profiles[idle_profile_for(overrides[i].bda)].name);
+            }
+        }
+        ESP_LOGI(CONN_PARAMS_TAG, "requests=%lu, rejects=%lu", requests, rejects);
+        if (baseline_events_milli)
+        {
+            ESP_LOGI(CONN_PARAMS_TAG, "connection events: %llu, at fast interval: %llu, saved %llu%%",
+                     radio_events_milli / 1000, baseline_events_milli / 1000,
+                     radio_events_milli < baseline_events_milli ? 100 - radio_events_milli * 100 / baseline_events_milli : 0);
+        }
+        break;
+    }
+}
+
+static void conn_params_task(void *pvParameters)
+{
+    conn_params_msg_t msg;
+
+    ESP_LOGI(CONN_PARAMS_TAG, "task start");
+
+    while (1)
+    {
+        if (xQueueReceive(conn_params_queue, &msg, POLICY_TICK))
+        {
+            handle_msg(&msg, xTaskGetTickCount());
+        }
+
+        TickType_t now = xTaskGetTickCount();
+        for (int i = 0; i < MAX_CONNECTIONS; i++)
+        {
+            conn_slot_t *slot = &slots[i];
+            if (!slot->in_use || !slot->ready ||
+                now - slot->last_activity < IDLE_AFTER ||
+                now - slot->requested_at < MIN_REQUEST_SPACING)
+            {
+                continue;
+            }
+
+            conn_profile_t idle_profile = idle_profile_for(slot->bda);
+            if (slot->requested != idle_profile)
+            {
+                request_profile(slot, idle_profile, now);
+            }
+        }
+    }
+
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,24 @@
+#ifndef PGP_CONN_PARAMS_H
+#define PGP_CONN_PARAMS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_bt_defs.h"
+
+// Connection parameter policy: fast interval while the handshake runs and while
+// LED/button traffic is going on, long interval with slave latency when idle.
+// Phones that reject the idle parameters get a milder profile next time.
+
+bool init_conn_params();
+
+// any task, never blocks: there was LED/button traffic on conn_id
+void conn_params_activity(uint16_t conn_id);
+
+// BTC task: feedback from ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT
+void conn_params_updated(const uint8_t *bda, int status, uint16_t conn_int, uint16_t latency, uint16_t timeout);
+
+// print current parameters, per-phone overrides and the estimated radio duty cycle
+void conn_params_dump();
+
+#endif /* PGP_CONN_PARAMS_H */
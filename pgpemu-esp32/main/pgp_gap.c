@@ -3,6 +3,7 @@
 #include "pgp_gap.h"
 
 #include "log_tags.h"
+#include "pgp_conn_params.h"
 #include "pgp_handshake_multi.h"
 #include "settings.h"
 
@@ -42,6 +43,14 @@ void pgp_advertise_stop()
     esp_ble_gap_stop_advertising();
 }
 
+void gap_conn_event_handler(const conn_event_t *event)
+{
+    if (event->type == CONN_EVENT_HANDSHAKE_COMPLETE || event->type == CONN_EVENT_DISCONNECTED)
+    {
+        advertise_if_needed();
+    }
+}
+
 void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
     switch (event)
@@ -81,6 +90,20 @@ void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
             ESP_LOGI(BT_GAP_TAG, "advertising stop successful");
         }
         break;
+    case ESP_GAP_BLE_AUTH_CMPL_EVT:
+    {
+        esp_ble_auth_cmpl_t *auth_cmpl = &param->ble_security.auth_cmpl;
+        if (!auth_cmpl->success)
+        {
+            ESP_LOGW(BT_GAP_TAG, "authentication failed, reason=0x%x", auth_cmpl->fail_reason);
+            break;
+        }
+
+        client_state_t *client_state = get_client_state_entry_by_bda(auth_cmpl->bd_addr);
+        conn_events_publish(CONN_EVENT_ENCRYPTED, client_state ? client_state->conn_id : 0xffff,
+                            0, auth_cmpl->bd_addr);
+        break;
+    }
     case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
         ESP_LOGI(BT_GAP_TAG, "update connection params status=%d, min_int=%d, max_int=%d, conn_int=%d, latency=%d, timeout=%d",
                  param->update_conn_params.status,
@@ -89,6 +112,9 @@ void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *par
                  param->update_conn_params.conn_int,
                  param->update_conn_params.latency,
                  param->update_conn_params.timeout);
+        conn_params_updated(param->update_conn_params.bda, param->update_conn_params.status,
+                            param->update_conn_params.conn_int, param->update_conn_params.latency,
+                            param->update_conn_params.timeout);
         break;
     default:
         break;
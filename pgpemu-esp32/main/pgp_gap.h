@@ -5,6 +5,8 @@
 
 #include "esp_gap_ble_api.h"
 
+#include "pgp_conn_events.h"
+
 static const uint8_t ADV_CONFIG_FLAG = (1 << 0);
 static const uint8_t SCAN_RSP_CONFIG_FLAG = (1 << 1);
 extern uint8_t adv_config_done;
@@ -20,4 +22,7 @@ void pgp_advertise_stop();
 
 void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
 
+// advertise again when a client connected or left
+void gap_conn_event_handler(const conn_event_t *event);
+
 #endif /* PGP_GAP_H */
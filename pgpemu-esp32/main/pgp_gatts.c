@@ -11,17 +11,25 @@
 
 #include "pgp_gatts.h"
 
+#include "gameplay_stats.h"
 #include "log_tags.h"
+#include "pgp_autobutton.h"
+#include "pgp_conn_events.h"
+#include "pgp_conn_params.h"
 #include "pgp_gap.h"
 #include "pgp_gatts_debug.h"
+#include "pgp_gatts_tx.h"
 #include "pgp_handshake.h"
 #include "pgp_handshake_multi.h"
 #include "pgp_led_handler.h"
+#include "pgp_trace.h"
 #include "secrets.h"
 #include "settings.h"
 #include "battery.h"
 
 #define PROFILE_NUM 1
+// battery, led/button and certificate
+#define PGP_GATTS_SERVICES 3
 #define PROFILE_APP_IDX 0
 
 #if 0
@@ -36,11 +44,8 @@ static const uint8_t LED_BUTTON_INST_ID = 1;
 static const uint8_t CERT_INST_ID = 2;
 #endif
 
-/* The max length of characteristic value. When the gatt client write or prepare write,
- *  the data length must be less than MAX_VALUE_LENGTH.
- */
-#define MAX_VALUE_LENGTH 500
-#define PREPARE_BUF_MAX_SIZE 1024
+// longest long write from the app is an led pattern, handshake writes are shorter
+#define PREPARE_BUF_MAX_SIZE LED_VALUE_MAX_LEN
 #define CHAR_DECLARATION_SIZE (sizeof(uint8_t))
 
 uint16_t battery_handle_table[BATTERY_LAST_IDX];
@@ -62,14 +67,17 @@ static uint8_t raw_scan_rsp_data[] = {
     /* service uuid */
     0x03, 0x03, 0xFF, 0x00};
 
+// reassembly buffer for long writes, one per connection (only used from the BTC task)
 typedef struct
 {
+    bool in_use;
+    uint16_t conn_id;
     uint16_t handle;
-    uint8_t *prepare_buf;
     int prepare_len;
+    uint8_t prepare_buf[PREPARE_BUF_MAX_SIZE];
 } prepare_type_env_t;
 
-static prepare_type_env_t prepare_write_env;
+static prepare_type_env_t prepare_write_pool[CONFIG_BT_ACL_CONNECTIONS];
 
 struct gatts_profile_inst
 {
@@ -88,8 +96,35 @@ struct gatts_profile_inst
 };
 
 static void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
-static void pgp_prepare_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
-static void pgp_exec_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param);
+static void pgp_prepare_write_event_env(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+static void pgp_exec_write_event_env(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
+static void pgp_gatts_disconnect(uint16_t conn_id);
+
+typedef void (*gatts_write_handler_t)(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len);
+
+typedef struct
+{
+    const char *name;
+    gatts_write_handler_t on_write;
+} handle_dispatch_entry_t;
+
+// room for all our attributes plus a few handles in case the stack leaves gaps between services
+#define HANDLE_DISPATCH_SIZE (BATTERY_LAST_IDX + LED_BUTTON_LAST_IDX + CERT_LAST_IDX + 8)
+
+// attribute handle (minus handle_dispatch_base) -> name and write handler.
+// rebuilt on every ESP_GATTS_CREAT_ATTR_TAB_EVT, only used from the BTC task afterwards.
+static handle_dispatch_entry_t handle_dispatch[HANDLE_DISPATCH_SIZE];
+static uint16_t handle_dispatch_base = 0;
+
+static void on_write_battery_cfg(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len);
+static void on_write_sfida_commands_cfg(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len);
+static void on_write_central_to_sfida(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len);
+static void on_write_led(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len);
+static void on_write_button_cfg(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len);
+
+static void build_handle_dispatch();
+static const handle_dispatch_entry_t *get_handle_dispatch_entry(uint16_t handle);
+static void dump_handle_dispatch();
 
 /* One gatt-based profile one app_id and one gatts_if, this array will store the gatts_if returned by ESP_GATTS_REG_EVT */
 static struct gatts_profile_inst pgp_profile_tab[PROFILE_NUM] = {
@@ -104,6 +139,10 @@ static struct gatts_profile_inst pgp_profile_tab[PROFILE_NUM] = {
     },
 };
 
+// free heap before the attribute tables are created, for the boot report
+static uint32_t heap_before_attr_tabs = 0;
+static int attr_tabs_created = 0;
+
 /* Service */
 static const uint16_t primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
 static const uint16_t character_declaration_uuid = ESP_GATT_UUID_CHAR_DECLARE;
@@ -113,117 +152,47 @@ static const uint8_t char_prop_write = ESP_GATT_CHAR_PROP_BIT_WRITE;
 
 static const uint8_t char_prop_read_notify = ESP_GATT_CHAR_PROP_BIT_READ | ESP_GATT_CHAR_PROP_BIT_NOTIFY;
 static const uint8_t char_prop_notify = ESP_GATT_CHAR_PROP_BIT_NOTIFY;
-static const uint8_t dummy_value[2] = {0x00, 0x00};
-static uint8_t cert_buffer[378] = {0};
+// initial value of every attribute, long enough for the biggest init_len
+static const uint8_t zero_value[LED_VALUE_MAX_LEN] = {0};
 
 static const uint16_t GATTS_SERVICE_UUID_BATTERY = 0x180f;
 static const uint16_t GATTS_CHAR_UUID_BATTERY_LEVEL = 0x2a19;
 
-static const esp_gatts_attr_db_t gatt_db_battery[BATTERY_LAST_IDX] = {
-
-    // Service Declaration
-    [IDX_BATTERY_SVC] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&primary_service_uuid, ESP_GATT_PERM_READ, sizeof(uint16_t), sizeof(GATTS_SERVICE_UUID_BATTERY), (uint8_t *)&GATTS_SERVICE_UUID_BATTERY}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_BATTERY_LEVEL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_notify}},
-    /* Characteristic Value */
-    [IDX_CHAR_BATTERY_LEVEL_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&GATTS_CHAR_UUID_BATTERY_LEVEL, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, 8, (uint8_t *)dummy_value}},
-
-    /* Client Characteristic Configuration Descriptor */
-    [IDX_CHAR_BATTERY_LEVEL_CFG] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(uint16_t), sizeof(dummy_value), (uint8_t *)dummy_value}},
-};
-
 // uuid in reversed order
-uint8_t GATTS_SERVICE_UUID_LED_BUTTON[ESP_UUID_LEN_128] = {0xeb, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
-uint8_t GATTS_CHAR_UUID_LED[ESP_UUID_LEN_128] = {0xec, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
-uint8_t GATTS_CHAR_UUID_BUTTON[ESP_UUID_LEN_128] = {0xed, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
-uint8_t GATTS_CHAR_UUID_UNKNOWN[ESP_UUID_LEN_128] = {0xee, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
-uint8_t GATTS_CHAR_UUID_UPDATE_REQUEST[ESP_UUID_LEN_128] = {0xef, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
-uint8_t GATTS_CHAR_UUID_FW_VERSION[ESP_UUID_LEN_128] = {0xf0, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
-
-static const uint8_t led_char_value[100] = {0};
-
-static const uint8_t button_value[2] = {0};
+static const uint8_t GATTS_SERVICE_UUID_LED_BUTTON[ESP_UUID_LEN_128] = {0xeb, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
+static const uint8_t GATTS_CHAR_UUID_LED[ESP_UUID_LEN_128] = {0xec, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
+static const uint8_t GATTS_CHAR_UUID_BUTTON[ESP_UUID_LEN_128] = {0xed, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
+static const uint8_t GATTS_CHAR_UUID_UNKNOWN[ESP_UUID_LEN_128] = {0xee, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
+static const uint8_t GATTS_CHAR_UUID_UPDATE_REQUEST[ESP_UUID_LEN_128] = {0xef, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
+static const uint8_t GATTS_CHAR_UUID_FW_VERSION[ESP_UUID_LEN_128] = {0xf0, 0x9a, 0x93, 0xb9, 0xb5, 0x82, 0x4c, 0x5c, 0xa3, 0x63, 0xcb, 0x67, 0x62, 0x4, 0xc5, 0x21};
+
+static const uint8_t GATTS_SERVICE_UUID_CERTIFICATE[ESP_UUID_LEN_128] = {0x37, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
+static const uint8_t GATTS_CHAR_UUID_CENTRAL_TO_SFIDA[ESP_UUID_LEN_128] = {0x38, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
+static const uint8_t GATTS_CHAR_UUID_SFIDA_COMMANDS[ESP_UUID_LEN_128] = {0x39, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
+static const uint8_t GATTS_CHAR_UUID_SFIDA_TO_CENTRAL[ESP_UUID_LEN_128] = {0x3a, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
 
-uint8_t GATTS_SERVICE_UUID_CERTIFICATE[ESP_UUID_LEN_128] = {0x37, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
-uint8_t GATTS_CHAR_UUID_CENTRAL_TO_SFIDA[ESP_UUID_LEN_128] = {0x38, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
-uint8_t GATTS_CHAR_UUID_SFIDA_COMMANDS[ESP_UUID_LEN_128] = {0x39, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
-uint8_t GATTS_CHAR_UUID_SFIDA_TO_CENTRAL[ESP_UUID_LEN_128] = {0x3a, 0x8e, 0xd, 0xef, 0x8e, 0x8b, 0x7f, 0xab, 0x33, 0x44, 0x89, 0x5b, 0x9, 0x77, 0xe8, 0xbb};
 /*
   {ESP_GATT_AUTO_RSP/ESP_GATT_RSP_BY_APP},
   {uuid_length, uuid_val, attribute permission, max length of element, current length of element, element value array}
 */
 
-static const esp_gatts_attr_db_t gatt_db_led_button[LED_BUTTON_LAST_IDX] = {
-    // Service Declaration
-    [IDX_LED_BUTTON_SVC] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&primary_service_uuid, ESP_GATT_PERM_READ, ESP_UUID_LEN_128, ESP_UUID_LEN_128, (uint8_t *)&GATTS_SERVICE_UUID_LED_BUTTON}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_LED] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_write}},
-    [IDX_CHAR_LED_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_LED, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, MAX_VALUE_LENGTH, sizeof(led_char_value), (uint8_t *)led_char_value}},
-
-    [IDX_CHAR_BUTTON] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_notify}},
-    [IDX_CHAR_BUTTON_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_BUTTON, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, sizeof(button_value), (uint8_t *)button_value}},
-
-    /* Client Characteristic Configuration Descriptor */
-    [IDX_CHAR_BUTTON_CFG] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(uint16_t), sizeof(dummy_value), (uint8_t *)dummy_value}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_UNKNOWN] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_write}},
-    [IDX_CHAR_UNKNOWN_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_UNKNOWN, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, sizeof(led_char_value), (uint8_t *)led_char_value}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_UPDATE_REQUEST] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_write}},
-    [IDX_CHAR_UPDATE_REQUEST_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_UPDATE_REQUEST, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, sizeof(led_char_value), (uint8_t *)led_char_value}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_FW_VERSION] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read}},
-    [IDX_CHAR_FW_VERSION_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_FW_VERSION, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, sizeof(led_char_value), (uint8_t *)led_char_value}},
+static const esp_gatts_attr_db_t gatt_db_battery[BATTERY_LAST_IDX] = {
+    PGP_GATTS_BATTERY_SCHEMA(SCHEMA_ATTR)};
 
-};
+static const esp_gatts_attr_db_t gatt_db_led_button[LED_BUTTON_LAST_IDX] = {
+    PGP_GATTS_LED_BUTTON_SCHEMA(SCHEMA_ATTR)};
 
 static const esp_gatts_attr_db_t gatt_db_certificate[CERT_LAST_IDX] = {
-    // Service Declaration
-    [IDX_CERT_SVC] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&primary_service_uuid, ESP_GATT_PERM_READ, ESP_UUID_LEN_128, ESP_UUID_LEN_128, (uint8_t *)&GATTS_SERVICE_UUID_CERTIFICATE}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_CENTRAL_TO_SFIDA] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_write}},
-    [IDX_CHAR_CENTRAL_TO_SFIDA_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_CENTRAL_TO_SFIDA, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, MAX_VALUE_LENGTH, sizeof(led_char_value), (uint8_t *)led_char_value}},
-
-    [IDX_CHAR_SFIDA_COMMANDS] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_notify}},
-    [IDX_CHAR_SFIDA_COMMANDS_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_SFIDA_COMMANDS, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, sizeof(led_char_value), (uint8_t *)led_char_value}},
-
-    /* Client Characteristic Configuration Descriptor */
-    [IDX_CHAR_SFIDA_COMMANDS_CFG] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(uint16_t), sizeof(dummy_value), (uint8_t *)dummy_value}},
-
-    /* Characteristic Declaration */
-    [IDX_CHAR_SFIDA_TO_CENTRAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read}},
-    [IDX_CHAR_SFIDA_TO_CENTRAL_VAL] =
-        {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)&GATTS_CHAR_UUID_SFIDA_TO_CENTRAL, ESP_GATT_PERM_READ, MAX_VALUE_LENGTH, sizeof(cert_buffer), (uint8_t *)cert_buffer}},
-};
+    PGP_GATTS_CERT_SCHEMA(SCHEMA_ATTR)};
+
+static const gatts_write_handler_t battery_write_handlers[BATTERY_LAST_IDX] = {
+    PGP_GATTS_BATTERY_SCHEMA(SCHEMA_WRITE_HANDLER)};
+
+static const gatts_write_handler_t led_button_write_handlers[LED_BUTTON_LAST_IDX] = {
+    PGP_GATTS_LED_BUTTON_SCHEMA(SCHEMA_WRITE_HANDLER)};
+
+static const gatts_write_handler_t cert_write_handlers[CERT_LAST_IDX] = {
+    PGP_GATTS_CERT_SCHEMA(SCHEMA_WRITE_HANDLER)};
 
 void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
 {
@@ -253,6 +222,10 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
         /* if (create_attr_ret){ */
         /*     ESP_LOGE(GATTS_TABLE_TAG, "create attr table failed, error code = %x", create_attr_ret); */
         /* } */
+        heap_before_attr_tabs = esp_get_free_heap_size();
+        attr_tabs_created = 0;
+        ESP_LOGI(BT_GATTS_TAG, "heap before attribute tables: free=%lu, min=%lu",
+                 heap_before_attr_tabs, esp_get_minimum_free_heap_size());
         esp_err_t create_attr_ret = esp_ble_gatts_create_attr_tab(gatt_db_battery, gatts_if, BATTERY_LAST_IDX, BATTERY_INST_ID);
         if (create_attr_ret)
         {
@@ -275,6 +248,8 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
     case ESP_GATTS_READ_EVT:
         ESP_LOGI(BT_GATTS_TAG, "ESP_GATTS_READ_EVT: %s, conn_id=%d",
                  char_name_from_handle(param->read.handle), param->read.conn_id);
+        trace_record(TRACE_READ, param->read.conn_id, param->read.handle, NULL, param->read.offset);
+        count_client_read(param->read.conn_id);
         if (pgp_get_handshake_state(param->read.conn_id) == 1)
         {
             if (esp_log_level_get(BT_GATTS_TAG) >= ESP_LOG_VERBOSE)
@@ -286,18 +261,15 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
                 }
             }
         }
-
-            if (battery_handle_table[IDX_CHAR_BATTERY_LEVEL_VAL] == param->read.handle){
-                uint8_t battery_value[] = {read_battery_value()};
-                esp_ble_gatts_set_attr_value(battery_handle_table[IDX_CHAR_BATTERY_LEVEL_VAL], 8, battery_value);
-            }
-		    break;
+        break;
     case ESP_GATTS_WRITE_EVT:
         ESP_LOGI(BT_GATTS_TAG, "ESP_GATTS_WRITE_EVT: %s, conn_id=%d",
                  char_name_from_handle(param->write.handle), param->write.conn_id);
+        trace_record(param->write.is_prep ? TRACE_PREP_WRITE : TRACE_WRITE, param->write.conn_id,
+                     param->write.handle, param->write.value, param->write.len);
         if (!param->write.is_prep)
         {
-            // the data length of gattc write  must be less than MAX_VALUE_LENGTH.
+            // the stack rejects writes longer than the max_len from pgp_gatts_schema.h
             ESP_LOGD(BT_GATTS_TAG, "GATT_WRITE_EVT handle=%d, value len=%d",
                      param->write.handle, param->write.len);
             if (esp_log_level_get(BT_GATTS_TAG) >= ESP_LOG_VERBOSE)
@@ -306,77 +278,53 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
                 ESP_LOG_BUFFER_HEX(BT_GATTS_TAG, param->write.value, param->write.len);
             }
 
-            if (certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_CFG] == param->write.handle)
-            {
-                uint16_t descr_value = param->write.value[1] << 8 | param->write.value[0];
-                handle_pgp_handshake_first(gatts_if, descr_value,
-                                           param->write.conn_id);
-            }
-            else if (certificate_handle_table[IDX_CHAR_CENTRAL_TO_SFIDA_VAL] == param->write.handle)
-            {
-                handle_pgp_handshake_second(gatts_if,
-                                            param->write.value, param->write.len,
-                                            param->write.conn_id);
-            }
-            else if (led_button_handle_table[IDX_CHAR_LED_VAL] == param->write.handle)
+            /* send response when param->write.need_rsp is true, before the handlers so the
+             * ATT transaction doesn't wait for the handshake crypto or the LED classifier */
+            if (param->write.need_rsp)
             {
-                handle_led_notify_from_app(gatts_if, param->write.conn_id, param->write.value);
-                return;
+                esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
             }
-            else if (led_button_handle_table[IDX_CHAR_BUTTON_CFG] == param->write.handle)
+
+            const handle_dispatch_entry_t *dispatch = get_handle_dispatch_entry(param->write.handle);
+            if (dispatch && dispatch->on_write)
             {
-                ESP_LOGW(BT_GATTS_TAG, "%s: unhandled CHAR_BUTTON_CFG", __func__);
-                return;
+                dispatch->on_write(gatts_if, param->write.conn_id, param->write.value, param->write.len);
             }
             else
             {
-                ESP_LOGW(BT_GATTS_TAG, "%s: unknown handle %d", __func__, param->write.handle);
-                // dump all tables
+                ESP_LOGW(BT_GATTS_TAG, "%s: unhandled write to %s (handle %d)", __func__,
+                         char_name_from_handle(param->write.handle), param->write.handle);
                 if (esp_log_level_get(BT_GATTS_TAG) >= ESP_LOG_DEBUG)
                 {
-                    for (int i = 0; i < BATTERY_LAST_IDX; i++)
-                    {
-                        ESP_LOGD(BT_GATTS_TAG, "handle: batt %d=%s",
-                                 battery_handle_table[i],
-                                 char_name_from_handle(battery_handle_table[i]));
-                    }
-                    for (int i = 0; i < LED_BUTTON_LAST_IDX; i++)
-                    {
-                        ESP_LOGD(BT_GATTS_TAG, "handle: ledb %d=%s",
-                                 led_button_handle_table[i],
-                                 char_name_from_handle(led_button_handle_table[i]));
-                    }
-                    for (int i = 0; i < CERT_LAST_IDX; i++)
-                    {
-                        ESP_LOGD(BT_GATTS_TAG, "handle: cert %d=%s",
-                                 certificate_handle_table[i],
-                                 char_name_from_handle(certificate_handle_table[i]));
-                    }
+                    dump_handle_dispatch();
                 }
             }
-
-            /* send response when param->write.need_rsp is true*/
-            if (param->write.need_rsp)
-            {
-                esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
-            }
         }
         else
         {
             /* handle prepare write */
-            pgp_prepare_write_event_env(gatts_if, &prepare_write_env, param);
+            pgp_prepare_write_event_env(gatts_if, param);
         }
         break;
     case ESP_GATTS_EXEC_WRITE_EVT:
-        // the length of gattc prapare write data must be less than MAX_VALUE_LENGTH.
+        // the length of gattc prepare write data must be less than PREPARE_BUF_MAX_SIZE.
         ESP_LOGD(BT_GATTS_TAG, "ESP_GATTS_EXEC_WRITE_EVT");
-        pgp_exec_write_event_env(gatts_if, &prepare_write_env, param);
+        trace_record(TRACE_EXEC_WRITE, param->exec_write.conn_id, 0, NULL, param->exec_write.exec_write_flag);
+        pgp_exec_write_event_env(gatts_if, param);
         break;
     case ESP_GATTS_MTU_EVT:
         ESP_LOGD(BT_GATTS_TAG, "ESP_GATTS_MTU_EVT, MTU %d", param->mtu.mtu);
+        trace_record(TRACE_MTU, param->mtu.conn_id, 0, NULL, param->mtu.mtu);
+        set_client_mtu(param->mtu.conn_id, param->mtu.mtu);
         break;
     case ESP_GATTS_CONF_EVT:
         ESP_LOGD(BT_GATTS_TAG, "ESP_GATTS_CONF_EVT, status = %d", param->conf.status);
+        trace_record(TRACE_CONF, param->conf.conn_id, param->conf.handle, NULL, param->conf.status);
+        gatts_tx_confirm(param->conf.conn_id, param->conf.handle, param->conf.status);
+        break;
+    case ESP_GATTS_CONGEST_EVT:
+        ESP_LOGD(BT_GATTS_TAG, "ESP_GATTS_CONGEST_EVT, conn_id=%d, congested=%d", param->congest.conn_id, param->congest.congested);
+        gatts_tx_congest(param->congest.conn_id, param->congest.congested);
         break;
     case ESP_GATTS_START_EVT:
         ESP_LOGD(BT_GATTS_TAG, "SERVICE_START_EVT, status %d, service_handle %d", param->start.status, param->start.service_handle);
@@ -386,30 +334,36 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
                  param->connect.conn_id,
                  param->connect.remote_bda[0], param->connect.remote_bda[1], param->connect.remote_bda[2],
                  param->connect.remote_bda[3], param->connect.remote_bda[4], param->connect.remote_bda[5]);
+        trace_record(TRACE_CONNECT, param->connect.conn_id, 0, param->connect.remote_bda, sizeof(esp_bd_addr_t));
 
-        esp_ble_conn_update_params_t conn_params = {
-            .min_int = 0,
-            .max_int = 0,
-            .latency = 0,
-            .timeout = 0,
-        };
-        memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
-        /* For the IOS system, please reference the apple official documents about the ble connection parameters restrictions. */
-        conn_params.latency = 0;
-        conn_params.max_int = 0x20; // max_int = 0x20*1.25ms = 40ms
-        conn_params.min_int = 0x10; // min_int = 0x10*1.25ms = 20ms
-        conn_params.timeout = 400;  // timeout = 400*10ms = 4000ms
-        // start sent the update connection parameters to the peer device.
-        esp_ble_gap_update_conn_params(&conn_params);
+        client_state_t *client_state = get_or_create_client_state_entry(param->connect.conn_id);
+        if (client_state)
+        {
+            client_state_begin_update(client_state);
+            memcpy(client_state->remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+            client_state_end_update(client_state);
+        }
+        else
+        {
+            ESP_LOGE(BT_GATTS_TAG, "no free client state for conn_id=%d", param->connect.conn_id);
+        }
+        // this also makes pgp_conn_params request the fast connection interval for the handshake
+        conn_events_publish(CONN_EVENT_CONNECTED, param->connect.conn_id, 0, param->connect.remote_bda);
 
         esp_ble_set_encryption(param->connect.remote_bda, ESP_BLE_SEC_ENCRYPT_MITM);
         break;
     case ESP_GATTS_DISCONNECT_EVT:
+        trace_record(TRACE_DISCONNECT, param->disconnect.conn_id, 0, NULL, param->disconnect.reason);
+        pgp_gatts_disconnect(param->disconnect.conn_id);
+        gatts_tx_disconnect(param->disconnect.conn_id);
+        autobutton_cancel(param->disconnect.conn_id);
         pgp_handshake_disconnect(param->disconnect.conn_id);
+        gameplay_stats_disconnect(param->disconnect.conn_id);
 
         ESP_LOGW(BT_GATTS_TAG, "ESP_GATTS_DISCONNECT_EVT, reason=%d, active_connections=%d",
                  param->disconnect.reason, get_active_connections());
-        advertise_if_needed();
+        conn_events_publish(CONN_EVENT_DISCONNECTED, param->disconnect.conn_id,
+                            param->disconnect.reason, param->disconnect.remote_bda);
         break;
     case ESP_GATTS_CREAT_ATTR_TAB_EVT:
     {
@@ -424,6 +378,8 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
             if (param->add_attr_tab.svc_uuid.uuid.uuid16 == GATTS_SERVICE_UUID_BATTERY)
             {
                 memcpy(battery_handle_table, param->add_attr_tab.handles, sizeof(battery_handle_table));
+                uint8_t level = get_battery_level();
+                esp_ble_gatts_set_attr_value(battery_handle_table[IDX_CHAR_BATTERY_LEVEL_VAL], sizeof(level), &level);
                 esp_ble_gatts_start_service(battery_handle_table[IDX_BATTERY_SVC]);
                 ESP_LOGD(BT_GATTS_TAG, "create battery attribute table success, handle = %d", param->add_attr_tab.num_handle);
                 found = 1;
@@ -460,6 +416,17 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
         {
             ESP_LOGE(BT_GATTS_TAG, "service not found");
         }
+        else
+        {
+            build_handle_dispatch();
+
+            if (++attr_tabs_created == PGP_GATTS_SERVICES)
+            {
+                uint32_t heap_after = esp_get_free_heap_size();
+                ESP_LOGI(BT_GATTS_TAG, "heap after attribute tables: free=%lu, min=%lu, tables used %ld bytes",
+                         heap_after, esp_get_minimum_free_heap_size(), (long)heap_before_attr_tabs - (long)heap_after);
+            }
+        }
         break;
     }
     case ESP_GATTS_STOP_EVT:
@@ -467,7 +434,6 @@ void gatts_profile_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts
     case ESP_GATTS_CANCEL_OPEN_EVT:
     case ESP_GATTS_CLOSE_EVT:
     case ESP_GATTS_LISTEN_EVT:
-    case ESP_GATTS_CONGEST_EVT:
     case ESP_GATTS_UNREG_EVT:
     case ESP_GATTS_DELETE_EVT:
     default:
@@ -511,22 +477,67 @@ void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp
     } while (0);
 }
 
-void pgp_prepare_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param)
+static prepare_type_env_t *get_prepare_write_env(uint16_t conn_id, bool create)
 {
-    ESP_LOGD(BT_GATTS_TAG, "prepare write, handle=%d, value len=%d", param->write.handle, param->write.len);
-    esp_gatt_status_t status = ESP_GATT_OK;
-    if (prepare_write_env->prepare_buf == NULL)
+    prepare_type_env_t *free_env = NULL;
+    for (int i = 0; i < CONFIG_BT_ACL_CONNECTIONS; i++)
     {
-        prepare_write_env->handle = param->write.handle;
-        prepare_write_env->prepare_buf = (uint8_t *)malloc(PREPARE_BUF_MAX_SIZE * sizeof(uint8_t));
-        prepare_write_env->prepare_len = 0;
-        if (prepare_write_env->prepare_buf == NULL)
+        if (prepare_write_pool[i].in_use)
+        {
+            if (prepare_write_pool[i].conn_id == conn_id)
+            {
+                return &prepare_write_pool[i];
+            }
+        }
+        else if (!free_env)
         {
-            ESP_LOGE(BT_GATTS_TAG, "%s, Gatt_server prep no mem", __func__);
-            status = ESP_GATT_NO_RESOURCES;
+            free_env = &prepare_write_pool[i];
         }
     }
-    else
+
+    if (!create || !free_env)
+    {
+        return NULL;
+    }
+
+    free_env->in_use = true;
+    free_env->conn_id = conn_id;
+    free_env->handle = 0;
+    free_env->prepare_len = 0;
+    return free_env;
+}
+
+static void release_prepare_write_env(prepare_type_env_t *prepare_write_env)
+{
+    prepare_write_env->in_use = false;
+    prepare_write_env->prepare_len = 0;
+}
+
+void pgp_prepare_write_event_env(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
+{
+    ESP_LOGD(BT_GATTS_TAG, "prepare write, conn_id=%d, handle=%d, offset=%d, value len=%d",
+             param->write.conn_id, param->write.handle, param->write.offset, param->write.len);
+    esp_gatt_status_t status = ESP_GATT_OK;
+
+    prepare_type_env_t *prepare_write_env = get_prepare_write_env(param->write.conn_id, true);
+    if (prepare_write_env == NULL)
+    {
+        ESP_LOGE(BT_GATTS_TAG, "%s, no free prepare buffer for conn_id=%d", __func__, param->write.conn_id);
+        status = ESP_GATT_NO_RESOURCES;
+    }
+    else if (prepare_write_env->prepare_len == 0)
+    {
+        prepare_write_env->handle = param->write.handle;
+    }
+    else if (prepare_write_env->handle != param->write.handle)
+    {
+        // only one long write per connection at a time, the app never interleaves them
+        ESP_LOGE(BT_GATTS_TAG, "%s, prepare write for handle %d while writing %d", __func__,
+                 param->write.handle, prepare_write_env->handle);
+        status = ESP_GATT_INVALID_HANDLE;
+    }
+
+    if (status == ESP_GATT_OK)
     {
         if (param->write.offset > PREPARE_BUF_MAX_SIZE)
         {
@@ -537,74 +548,251 @@ void pgp_prepare_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *pre
             status = ESP_GATT_INVALID_ATTR_LEN;
         }
     }
+
     /*send response when param->write.need_rsp is true */
     if (param->write.need_rsp)
     {
-        ESP_LOGE(BT_GATTS_TAG, "need_rsp not implemented");
-#if 0
-        esp_gatt_rsp_t *gatt_rsp = (esp_gatt_rsp_t *)malloc(sizeof(esp_gatt_rsp_t));
-        if (gatt_rsp != NULL)
-        {
-
-            /*
-                gatt_rsp->attr_value.len = param->write.len;
-                gatt_rsp->attr_value.handle = param->write.handle;
-                gatt_rsp->attr_value.offset = param->write.offset;
-                gatt_rsp->attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
-                memcpy(gatt_rsp->attr_value.value, param->write.value, param->write.len);
-                esp_err_t response_err = esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, gatt_rsp);
-                if (response_err != ESP_OK){
-                   ESP_LOGE(GATTS_TABLE_TAG, "Send response error");
-                }
-                free(gatt_rsp);
-            */
-        }
-        else
+        // esp_gatt_rsp_t is >600 bytes, keep it off the BTC task stack
+        static esp_gatt_rsp_t gatt_rsp;
+        gatt_rsp.attr_value.len = param->write.len;
+        gatt_rsp.attr_value.handle = param->write.handle;
+        gatt_rsp.attr_value.offset = param->write.offset;
+        gatt_rsp.attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+        memcpy(gatt_rsp.attr_value.value, param->write.value, param->write.len);
+        esp_err_t response_err = esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, &gatt_rsp);
+        if (response_err != ESP_OK)
         {
-            ESP_LOGE(BT_GATTS_TAG, "%s, malloc failed", __func__);
+            ESP_LOGE(BT_GATTS_TAG, "send response error");
         }
-#endif
     }
     if (status != ESP_GATT_OK)
     {
+        ESP_LOGW(BT_GATTS_TAG, "%s, prepare write rejected, status=%d", __func__, status);
         return;
     }
     memcpy(prepare_write_env->prepare_buf + param->write.offset,
            param->write.value,
            param->write.len);
-    prepare_write_env->prepare_len += param->write.len;
+    if (param->write.offset + param->write.len > prepare_write_env->prepare_len)
+    {
+        prepare_write_env->prepare_len = param->write.offset + param->write.len;
+    }
 }
 
-void pgp_exec_write_event_env(esp_gatt_if_t gatts_if, prepare_type_env_t *prepare_write_env, esp_ble_gatts_cb_param_t *param)
+void pgp_exec_write_event_env(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param)
 {
-    if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC && prepare_write_env->prepare_buf)
+    uint16_t conn_id = param->exec_write.conn_id;
+    prepare_type_env_t *prepare_write_env = get_prepare_write_env(conn_id, false);
+    if (prepare_write_env == NULL)
+    {
+        ESP_LOGW(BT_GATTS_TAG, "exec write without prepared data, conn_id=%d", conn_id);
+        return;
+    }
+
+    if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC && prepare_write_env->prepare_len > 0)
     {
         ESP_LOG_BUFFER_HEX(BT_GATTS_TAG, prepare_write_env->prepare_buf, prepare_write_env->prepare_len);
 
         // it seems that this will be called only by Android version of the Pokemon Go App
         ESP_LOGD(BT_GATTS_TAG, "WRITE EVT");
 
-        if (certificate_handle_table[IDX_CHAR_CENTRAL_TO_SFIDA_VAL] == prepare_write_env->handle)
+        // the handlers work directly on the pooled buffer, it is only reused after they return
+        const handle_dispatch_entry_t *dispatch = get_handle_dispatch_entry(prepare_write_env->handle);
+        if (dispatch && dispatch->on_write)
         {
-
-            handle_pgp_handshake_second(gatts_if,
-                                        prepare_write_env->prepare_buf,
-                                        prepare_write_env->prepare_len,
-                                        param->write.conn_id);
+            dispatch->on_write(gatts_if, conn_id, prepare_write_env->prepare_buf, prepare_write_env->prepare_len);
         }
-        else if (led_button_handle_table[IDX_CHAR_LED_VAL] == prepare_write_env->handle)
+        else
         {
-            handle_led_notify_from_app(gatts_if, param->write.conn_id, prepare_write_env->prepare_buf);
+            ESP_LOGW(BT_GATTS_TAG, "%s: unhandled long write to %s (handle %d)", __func__,
+                     char_name_from_handle(prepare_write_env->handle), prepare_write_env->handle);
         }
     }
     else
     {
         ESP_LOGI(BT_GATTS_TAG, "ESP_GATT_PREP_WRITE_CANCEL");
     }
-    if (prepare_write_env->prepare_buf)
+
+    release_prepare_write_env(prepare_write_env);
+}
+
+void pgp_gatts_disconnect(uint16_t conn_id)
+{
+    // drop a long write that was interrupted by the disconnect
+    prepare_type_env_t *prepare_write_env = get_prepare_write_env(conn_id, false);
+    if (prepare_write_env)
     {
-        free(prepare_write_env->prepare_buf);
-        prepare_write_env->prepare_buf = NULL;
+        release_prepare_write_env(prepare_write_env);
     }
-    prepare_write_env->prepare_len = 0;
+}
+
+static void on_write_battery_cfg(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    client_state_t *client_state = get_client_state_entry(conn_id);
+    if (len < 2 || !client_state)
+    {
+        ESP_LOGE(BT_GATTS_TAG, "%s: can't handle write, len=%d, conn_id=%d", __func__, len, conn_id);
+        return;
+    }
+
+    set_client_subscription(client_state, SUBSCRIPTION_BATTERY, (value[0] & 0x01) != 0);
+}
+
+void update_battery_level_attr(uint8_t level)
+{
+    // static to keep it off the caller's stack
+    static client_state_t snapshot;
+
+    uint16_t handle = battery_handle_table[IDX_CHAR_BATTERY_LEVEL_VAL];
+    if (!handle)
+    {
+        // table not created yet, the value is set once it is
+        return;
+    }
+
+    // reads are answered by the stack from this value
+    esp_ble_gatts_set_attr_value(handle, sizeof(level), &level);
+
+    for (int i = 0; i < CONFIG_BT_ACL_CONNECTIONS; i++)
+    {
+        if (!get_client_state_snapshot(i, &snapshot))
+        {
+            continue;
+        }
+        if (client_subscribed(&snapshot, SUBSCRIPTION_BATTERY))
+        {
+            gatts_tx_send(pgp_profile_tab[PROFILE_APP_IDX].gatts_if, snapshot.conn_id, snapshot.generation, handle, &level, sizeof(level), 0);
+        }
+        else if (snapshot.subscriptions & (1 << SUBSCRIPTION_BATTERY))
+        {
+            // subscribed but the handshake isn't done, this one used to be sent anyway.
+            // unsubscribed clients were always skipped, counting them wouldn't mean anything.
+            count_prevented_send(SUBSCRIPTION_BATTERY);
+        }
+    }
+}
+
+static void on_write_sfida_commands_cfg(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    if (len < 2)
+    {
+        ESP_LOGE(BT_GATTS_TAG, "%s: descriptor write too short: %d", __func__, len);
+        return;
+    }
+    uint16_t descr_value = value[1] << 8 | value[0];
+    handle_pgp_handshake_first(gatts_if, descr_value, conn_id);
+}
+
+static void on_write_central_to_sfida(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    handle_pgp_handshake_second(gatts_if, value, len, conn_id);
+}
+
+static void on_write_led(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    conn_params_activity(conn_id);
+    handle_led_notify_from_app(gatts_if, conn_id, value, len);
+}
+
+static void on_write_button_cfg(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *value, uint16_t len)
+{
+    client_state_t *client_state = get_client_state_entry(conn_id);
+    if (len < 2 || !client_state)
+    {
+        ESP_LOGE(BT_GATTS_TAG, "%s: can't handle write, len=%d, conn_id=%d", __func__, len, conn_id);
+        return;
+    }
+
+    set_client_subscription(client_state, SUBSCRIPTION_BUTTON, (value[0] & 0x01) != 0);
+}
+
+static uint16_t lowest_handle(uint16_t lowest, const uint16_t *handle_table, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (handle_table[i] != 0 && (lowest == 0 || handle_table[i] < lowest))
+        {
+            lowest = handle_table[i];
+        }
+    }
+    return lowest;
+}
+
+static void add_handle_dispatch(const uint16_t *handle_table, int count,
+                                const char *const *names, const gatts_write_handler_t *write_handlers)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (handle_table[i] == 0)
+        {
+            // table not created yet
+            continue;
+        }
+
+        int idx = handle_table[i] - handle_dispatch_base;
+        if (idx >= HANDLE_DISPATCH_SIZE)
+        {
+            ESP_LOGE(BT_GATTS_TAG, "handle %d (%s) out of dispatch range", handle_table[i], names[i]);
+            continue;
+        }
+
+        handle_dispatch[idx].name = names[i];
+        handle_dispatch[idx].on_write = write_handlers ? write_handlers[i] : NULL;
+    }
+}
+
+// called whenever a handle table was filled in. the tables may arrive in any order,
+// so just rebuild everything from the tables that are known so far.
+static void build_handle_dispatch()
+{
+    uint16_t base = 0;
+    base = lowest_handle(base, battery_handle_table, BATTERY_LAST_IDX);
+    base = lowest_handle(base, led_button_handle_table, LED_BUTTON_LAST_IDX);
+    base = lowest_handle(base, certificate_handle_table, CERT_LAST_IDX);
+
+    memset(handle_dispatch, 0, sizeof(handle_dispatch));
+    handle_dispatch_base = base;
+
+    add_handle_dispatch(battery_handle_table, BATTERY_LAST_IDX, battery_char_names, battery_write_handlers);
+    add_handle_dispatch(led_button_handle_table, LED_BUTTON_LAST_IDX, led_button_char_names, led_button_write_handlers);
+    add_handle_dispatch(certificate_handle_table, CERT_LAST_IDX, cert_char_names, cert_write_handlers);
+}
+
+static const handle_dispatch_entry_t *get_handle_dispatch_entry(uint16_t handle)
+{
+    if (handle_dispatch_base == 0 || handle < handle_dispatch_base)
+    {
+        return NULL;
+    }
+
+    int idx = handle - handle_dispatch_base;
+    if (idx >= HANDLE_DISPATCH_SIZE || !handle_dispatch[idx].name)
+    {
+        return NULL;
+    }
+
+    return &handle_dispatch[idx];
+}
+
+static void dump_handle_dispatch()
+{
+    for (int i = 0; i < HANDLE_DISPATCH_SIZE; i++)
+    {
+        if (handle_dispatch[i].name)
+        {
+            ESP_LOGD(BT_GATTS_TAG, "handle: %d=%s%s", handle_dispatch_base + i, handle_dispatch[i].name,
+                     handle_dispatch[i].on_write ? " (write handler)" : "");
+        }
+    }
+}
+
+// for debugging
+const char *char_name_from_handle(uint16_t handle)
+{
+    const handle_dispatch_entry_t *dispatch = get_handle_dispatch_entry(handle);
+    if (!dispatch)
+    {
+        return "<UNKNOWN HANDLE NAME>";
+    }
+    return dispatch->name;
 }
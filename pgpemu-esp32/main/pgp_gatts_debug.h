@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
+#include "pgp_gatts.h"
+
+// characteristic names, indexed like the handle tables
+extern const char *const battery_char_names[BATTERY_LAST_IDX];
+extern const char *const led_button_char_names[LED_BUTTON_LAST_IDX];
+extern const char *const cert_char_names[CERT_LAST_IDX];
+
+// constant time, uses the handle dispatch table in pgp_gatts.c
 const char *char_name_from_handle(uint16_t handle);
 
 #endif /* PGP_GATTS_DEBUG_H */
@@ -0,0 +1,90 @@
+#ifndef PGP_GATTS_SCHEMA_H
+#define PGP_GATTS_SCHEMA_H
+
+/*
+ * Single source for the GATT layout. Every service is a list of rows
+ *
+ *   X(name, uuid_len, uuid, perm, max_len, init_len, init_value, on_write)
+ *
+ * which is expanded into the IDX_<name> enums (pgp_gatts.h), the debug names
+ * (pgp_gatts_debug.c) and the attribute databases and write dispatch (pgp_gatts.c).
+ * uuid, init_value and on_write are only evaluated in pgp_gatts.c.
+ *
+ * Bluedroid allocates max_len bytes of heap for every value attribute, so keep
+ * max_len at the real protocol size.
+ */
+
+// longest LED pattern the app writes: 4 byte header + 31 entries of 3 bytes
+#define LED_VALUE_MAX_LEN (4 + 3 * 31)
+// 10 button samples, 2 bits in the first byte
+#define BUTTON_VALUE_MAX_LEN 2
+// longest handshake write from the app (next_challenge)
+#define CENTRAL_TO_SFIDA_MAX_LEN 52
+// handshake state notifications
+#define SFIDA_COMMANDS_MAX_LEN 4
+// chal_0 (challenge_data)
+#define SFIDA_TO_CENTRAL_MAX_LEN 378
+// starts out as an empty 4 byte header until the handshake sets it
+#define SFIDA_TO_CENTRAL_INIT_LEN 4
+// characteristics the app doesn't use, one write at the default MTU
+#define UNUSED_VALUE_MAX_LEN 20
+
+#define SCHEMA_SERVICE(X, name, uuid_len, uuid) \
+    X(name, ESP_UUID_LEN_16, &primary_service_uuid, ESP_GATT_PERM_READ, uuid_len, uuid_len, uuid, NULL)
+
+#define SCHEMA_CHAR_DECL(X, name, props) \
+    X(name, ESP_UUID_LEN_16, &character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, &props, NULL)
+
+#define SCHEMA_CCCD(X, name, on_write) \
+    X(name, ESP_UUID_LEN_16, &character_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(uint16_t), sizeof(uint16_t), zero_value, on_write)
+
+// Battery service
+#define PGP_GATTS_BATTERY_SCHEMA(X)                                                                                             \
+    SCHEMA_SERVICE(X, BATTERY_SVC, ESP_UUID_LEN_16, &GATTS_SERVICE_UUID_BATTERY)                                                \
+    SCHEMA_CHAR_DECL(X, CHAR_BATTERY_LEVEL, char_prop_read_notify)                                                              \
+    X(CHAR_BATTERY_LEVEL_VAL, ESP_UUID_LEN_16, &GATTS_CHAR_UUID_BATTERY_LEVEL, ESP_GATT_PERM_READ, 1, 1, zero_value, NULL)      \
+    SCHEMA_CCCD(X, CHAR_BATTERY_LEVEL_CFG, on_write_battery_cfg)
+
+// LED/BUTTON service
+#define PGP_GATTS_LED_BUTTON_SCHEMA(X)                                                                                          \
+    SCHEMA_SERVICE(X, LED_BUTTON_SVC, ESP_UUID_LEN_128, GATTS_SERVICE_UUID_LED_BUTTON)                                          \
+    SCHEMA_CHAR_DECL(X, CHAR_LED, char_prop_write)                                                                              \
+    X(CHAR_LED_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_LED, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,                             \
+      LED_VALUE_MAX_LEN, LED_VALUE_MAX_LEN, zero_value, on_write_led)                                                           \
+    SCHEMA_CHAR_DECL(X, CHAR_BUTTON, char_prop_notify)                                                                          \
+    X(CHAR_BUTTON_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_BUTTON, ESP_GATT_PERM_READ,                                            \
+      BUTTON_VALUE_MAX_LEN, BUTTON_VALUE_MAX_LEN, zero_value, NULL)                                                             \
+    SCHEMA_CCCD(X, CHAR_BUTTON_CFG, on_write_button_cfg)                                                                        \
+    SCHEMA_CHAR_DECL(X, CHAR_UNKNOWN, char_prop_write)                                                                          \
+    X(CHAR_UNKNOWN_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_UNKNOWN, ESP_GATT_PERM_READ,                                          \
+      UNUSED_VALUE_MAX_LEN, UNUSED_VALUE_MAX_LEN, zero_value, NULL)                                                             \
+    SCHEMA_CHAR_DECL(X, CHAR_UPDATE_REQUEST, char_prop_write)                                                                   \
+    X(CHAR_UPDATE_REQUEST_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_UPDATE_REQUEST, ESP_GATT_PERM_READ,                            \
+      UNUSED_VALUE_MAX_LEN, UNUSED_VALUE_MAX_LEN, zero_value, NULL)                                                             \
+    SCHEMA_CHAR_DECL(X, CHAR_FW_VERSION, char_prop_read)                                                                        \
+    X(CHAR_FW_VERSION_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_FW_VERSION, ESP_GATT_PERM_READ,                                    \
+      UNUSED_VALUE_MAX_LEN, UNUSED_VALUE_MAX_LEN, zero_value, NULL)
+
+// Certificate service
+#define PGP_GATTS_CERT_SCHEMA(X)                                                                                                \
+    SCHEMA_SERVICE(X, CERT_SVC, ESP_UUID_LEN_128, GATTS_SERVICE_UUID_CERTIFICATE)                                               \
+    SCHEMA_CHAR_DECL(X, CHAR_CENTRAL_TO_SFIDA, char_prop_write)                                                                 \
+    X(CHAR_CENTRAL_TO_SFIDA_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_CENTRAL_TO_SFIDA, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE,   \
+      CENTRAL_TO_SFIDA_MAX_LEN, CENTRAL_TO_SFIDA_MAX_LEN, zero_value, on_write_central_to_sfida)                                \
+    SCHEMA_CHAR_DECL(X, CHAR_SFIDA_COMMANDS, char_prop_notify)                                                                  \
+    X(CHAR_SFIDA_COMMANDS_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_SFIDA_COMMANDS, ESP_GATT_PERM_READ,                            \
+      SFIDA_COMMANDS_MAX_LEN, SFIDA_COMMANDS_MAX_LEN, zero_value, NULL)                                                         \
+    SCHEMA_CCCD(X, CHAR_SFIDA_COMMANDS_CFG, on_write_sfida_commands_cfg)                                                        \
+    SCHEMA_CHAR_DECL(X, CHAR_SFIDA_TO_CENTRAL, char_prop_read)                                                                  \
+    X(CHAR_SFIDA_TO_CENTRAL_VAL, ESP_UUID_LEN_128, GATTS_CHAR_UUID_SFIDA_TO_CENTRAL, ESP_GATT_PERM_READ,                        \
+      SFIDA_TO_CENTRAL_MAX_LEN, SFIDA_TO_CENTRAL_INIT_LEN, zero_value, NULL)
+
+// expanders
+#define SCHEMA_IDX(name, ...) IDX_##name,
+#define SCHEMA_NAME(name, ...) [IDX_##name] = #name,
+#define SCHEMA_ATTR(name, uuid_len, uuid, perm, max_len, init_len, init_value, on_write) \
+    [IDX_##name] = {{ESP_GATT_AUTO_RSP}, {uuid_len, (uint8_t *)(uuid), perm, max_len, init_len, (uint8_t *)(init_value)}},
+#define SCHEMA_WRITE_HANDLER(name, uuid_len, uuid, perm, max_len, init_len, init_value, on_write) \
+    [IDX_##name] = on_write,
+
+#endif /* PGP_GATTS_SCHEMA_H */
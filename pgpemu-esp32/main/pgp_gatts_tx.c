@@ -0,0 +1,546 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "esp_gatts_api.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "pgp_gatts_tx.h"
+
+#include "histogram.h"
+#include "log_tags.h"
+#include "pgp_handshake_multi.h"
+#include "pgp_trace.h"
+
+#define MAX_CONNECTIONS CONFIG_BT_ACL_CONNECTIONS
+// items waiting per connection
+#define TX_QUEUE_LEN 8
+// input queue of the tx task, the last few slots are kept free for feedback from the BTC task
+#define TX_INPUT_QUEUE_LEN 24
+#define TX_INPUT_RESERVED 8
+
+#define TX_MAX_RETRIES 3
+static const TickType_t TX_RETRY_DELAY = pdMS_TO_TICKS(30);
+// notifications are confirmed locally once the stack handed them to the controller
+static const TickType_t TX_CONFIRM_TIMEOUT = pdMS_TO_TICKS(1000);
+
+typedef enum
+{
+    TX_MSG_DATA,
+    TX_MSG_CONFIRM,
+    TX_MSG_CONGEST,
+    TX_MSG_DISCONNECT,
+} tx_msg_type_t;
+
+typedef struct
+{
+    esp_gatt_if_t gatts_if;
+    uint16_t handle;
+    uint16_t len;
+    uint8_t data[GATTS_TX_MAX_LEN];
+    TickType_t deadline;
+    // when gatts_tx_send() was called, for the latency estimate
+    TickType_t queued_at;
+    int retries;
+} tx_item_t;
+
+typedef struct
+{
+    tx_msg_type_t type;
+    uint16_t conn_id;
+    // session of conn_id this message belongs to, conn_ids are reused but generations aren't
+    uint32_t generation;
+    union
+    {
+        tx_item_t item;
+        struct
+        {
+            uint16_t handle;
+            esp_gatt_status_t status;
+        } confirm;
+        bool congested;
+    };
+} tx_msg_t;
+
+// per connection state, only touched by the tx task
+typedef struct
+{
+    bool in_use;
+    uint16_t conn_id;
+    uint32_t generation;
+    bool congested;
+    // head item was sent and waits for ESP_GATTS_CONF_EVT
+    bool in_flight;
+    TickType_t in_flight_since;
+    // don't send the head item before this tick (retry backoff)
+    TickType_t retry_at;
+    tx_item_t items[TX_QUEUE_LEN];
+    int head;
+    int count;
+} tx_conn_t;
+
+typedef struct
+{
+    atomic_uint queued;
+    atomic_uint sent;
+    atomic_uint retries;
+    atomic_uint unconfirmed;
+    atomic_uint dropped_full;
+    atomic_uint dropped_stale;
+    atomic_uint dropped_failed;
+    atomic_uint dropped_disconnect;
+    atomic_uint dropped_session;
+    atomic_uint congestions;
+    atomic_int max_depth;
+} tx_stats_t;
+
+static QueueHandle_t tx_input_queue = NULL;
+static tx_conn_t tx_conns[MAX_CONNECTIONS];
+static tx_stats_t tx_stats;
+// queue depth per tx_conns slot, for dump_gatts_tx_stats()
+static atomic_int tx_depth[MAX_CONNECTIONS];
+static atomic_uint tx_depth_conn_id[MAX_CONNECTIONS];
+// send to confirm latency, only written by the tx task
+static histogram_t tx_latency = HISTOGRAM_INIT("send to confirm latency", "ms");
+// decaying peak of the latency, so one slow send keeps the estimate up for a while
+static atomic_uint tx_latency_peak_ms = 0;
+
+static void gatts_tx_task(void *pvParameters);
+
+bool init_gatts_tx()
+{
+    tx_input_queue = xQueueCreate(TX_INPUT_QUEUE_LEN, sizeof(tx_msg_t));
+    if (!tx_input_queue)
+    {
+        ESP_LOGE(GATTS_TX_TAG, "%s creating tx queue failed", __func__);
+        return false;
+    }
+
+    xTaskCreate(gatts_tx_task, "gatts_tx", 3072, NULL, 15, NULL);
+
+    return true;
+}
+
+bool gatts_tx_send(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t generation, uint16_t handle,
+                   const uint8_t *data, uint16_t len, TickType_t deadline)
+{
+    if (len > GATTS_TX_MAX_LEN)
+    {
+        ESP_LOGE(GATTS_TX_TAG, "%s: %d b is too long", __func__, len);
+        return false;
+    }
+
+    tx_msg_t msg;
+    msg.type = TX_MSG_DATA;
+    msg.conn_id = conn_id;
+    msg.generation = generation;
+    msg.item.gatts_if = gatts_if;
+    msg.item.handle = handle;
+    msg.item.len = len;
+    memcpy(msg.item.data, data, len);
+    msg.item.deadline = deadline;
+    msg.item.queued_at = xTaskGetTickCount();
+    msg.item.retries = 0;
+
+    // leave room for confirmations so the tx task never loses track of the link state
+    if (!tx_input_queue || uxQueueSpacesAvailable(tx_input_queue) <= TX_INPUT_RESERVED ||
+        xQueueSend(tx_input_queue, &msg, 0) != pdTRUE)
+    {
+        atomic_fetch_add(&tx_stats.dropped_full, 1);
+        ESP_LOGW(GATTS_TX_TAG, "tx queue full, dropping item for conn_id=%d", conn_id);
+        return false;
+    }
+
+    return true;
+}
+
+// BTC task: session of conn_id, 0 if it has none
+static uint32_t current_generation(uint16_t conn_id)
+{
+    client_state_t *entry = get_client_state_entry(conn_id);
+    return entry ? entry->generation : 0;
+}
+
+// confirmations and congestion may overtake queued data, a disconnect must not: data queued
+// before it would otherwise create a new slot for the dead connection.
+static void post_feedback(tx_msg_t *msg, bool urgent)
+{
+    msg->generation = current_generation(msg->conn_id);
+    BaseType_t ok = pdFALSE;
+    if (tx_input_queue)
+    {
+        ok = urgent ? xQueueSendToFront(tx_input_queue, msg, 0) : xQueueSend(tx_input_queue, msg, 0);
+    }
+    if (ok != pdTRUE)
+    {
+        ESP_LOGE(GATTS_TX_TAG, "tx queue full, lost feedback %d for conn_id=%d", msg->type, msg->conn_id);
+    }
+}
+
+void gatts_tx_confirm(uint16_t conn_id, uint16_t handle, esp_gatt_status_t status)
+{
+    tx_msg_t msg = {
+        .type = TX_MSG_CONFIRM,
+        .conn_id = conn_id,
+        .confirm = {.handle = handle, .status = status},
+    };
+    post_feedback(&msg, true);
+}
+
+void gatts_tx_congest(uint16_t conn_id, bool congested)
+{
+    tx_msg_t msg = {
+        .type = TX_MSG_CONGEST,
+        .conn_id = conn_id,
+        .congested = congested,
+    };
+    post_feedback(&msg, true);
+}
+
+void gatts_tx_disconnect(uint16_t conn_id)
+{
+    tx_msg_t msg = {
+        .type = TX_MSG_DISCONNECT,
+        .conn_id = conn_id,
+    };
+    post_feedback(&msg, false);
+}
+
+static void update_depth(tx_conn_t *conn)
+{
+    int idx = conn - tx_conns;
+    atomic_store(&tx_depth_conn_id[idx], conn->conn_id);
+    atomic_store(&tx_depth[idx], conn->in_use ? conn->count : 0);
+
+    int max_depth = atomic_load(&tx_stats.max_depth);
+    while (conn->count > max_depth && !atomic_compare_exchange_weak(&tx_stats.max_depth, &max_depth, conn->count))
+    {
+    }
+}
+
+// true if generation is the session conn_id has right now
+static bool session_alive(uint16_t conn_id, uint32_t generation)
+{
+    // static to keep it off the task stack
+    static client_state_t snapshot;
+    return generation && get_client_state_snapshot_by_conn_id(conn_id, &snapshot) && snapshot.generation == generation;
+}
+
+static void free_tx_conn(tx_conn_t *conn)
+{
+    if (conn->count)
+    {
+        ESP_LOGW(GATTS_TX_TAG, "conn_id=%d disconnected, dropping %d items", conn->conn_id, conn->count);
+        atomic_fetch_add(&tx_stats.dropped_disconnect, conn->count);
+    }
+    conn->in_use = false;
+    conn->count = 0;
+    update_depth(conn);
+}
+
+// returns NULL if generation isn't the session of the slot for conn_id
+static tx_conn_t *get_tx_conn(uint16_t conn_id, uint32_t generation, bool create)
+{
+    tx_conn_t *free_conn = NULL;
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        if (tx_conns[i].in_use)
+        {
+            if (tx_conns[i].conn_id != conn_id)
+            {
+                continue;
+            }
+            if (tx_conns[i].generation == generation)
+            {
+                return &tx_conns[i];
+            }
+            if (!create)
+            {
+                return NULL;
+            }
+            // the disconnect of the previous session was lost, its items must not reach the new one
+            free_tx_conn(&tx_conns[i]);
+            free_conn = &tx_conns[i];
+            break;
+        }
+        else if (!free_conn)
+        {
+            free_conn = &tx_conns[i];
+        }
+    }
+
+    if (!create || !free_conn)
+    {
+        return NULL;
+    }
+
+    memset(free_conn, 0, sizeof(tx_conn_t));
+    free_conn->in_use = true;
+    free_conn->conn_id = conn_id;
+    free_conn->generation = generation;
+    return free_conn;
+}
+
+static void record_latency(const tx_item_t *item, TickType_t now)
+{
+    uint32_t ms = pdTICKS_TO_MS(now - item->queued_at);
+    histogram_add(&tx_latency, ms);
+
+    unsigned int peak = atomic_load(&tx_latency_peak_ms);
+    if (ms > peak)
+    {
+        peak = (peak + ms + 1) / 2;
+    }
+    else
+    {
+        peak -= (peak - ms) / 16;
+    }
+    atomic_store(&tx_latency_peak_ms, peak);
+}
+
+static void pop_item(tx_conn_t *conn)
+{
+    conn->head = (conn->head + 1) % TX_QUEUE_LEN;
+    conn->count--;
+    conn->in_flight = false;
+    conn->retry_at = 0;
+    update_depth(conn);
+}
+
+static void push_item(uint16_t conn_id, uint32_t generation, const tx_item_t *item)
+{
+    // items queued before a disconnect or by a task that didn't notice it yet
+    if (!session_alive(conn_id, generation))
+    {
+        atomic_fetch_add(&tx_stats.dropped_session, 1);
+        ESP_LOGW(GATTS_TX_TAG, "conn_id=%d session %lu is gone, dropping item", conn_id, generation);
+        return;
+    }
+
+    tx_conn_t *conn = get_tx_conn(conn_id, generation, true);
+    if (!conn || conn->count >= TX_QUEUE_LEN)
+    {
+        atomic_fetch_add(&tx_stats.dropped_full, 1);
+        ESP_LOGW(GATTS_TX_TAG, "queue for conn_id=%d full, dropping item", conn_id);
+        return;
+    }
+
+    memcpy(&conn->items[(conn->head + conn->count) % TX_QUEUE_LEN], item, sizeof(tx_item_t));
+    conn->count++;
+    atomic_fetch_add(&tx_stats.queued, 1);
+    update_depth(conn);
+}
+
+// head item failed, try again a bit later or give up
+static void retry_item(tx_conn_t *conn, TickType_t now)
+{
+    tx_item_t *item = &conn->items[conn->head];
+    conn->in_flight = false;
+    if (++item->retries > TX_MAX_RETRIES)
+    {
+        atomic_fetch_add(&tx_stats.dropped_failed, 1);
+        ESP_LOGW(GATTS_TX_TAG, "giving up on item for conn_id=%d after %d retries", conn->conn_id, TX_MAX_RETRIES);
+        pop_item(conn);
+        return;
+    }
+
+    atomic_fetch_add(&tx_stats.retries, 1);
+    conn->retry_at = now + TX_RETRY_DELAY;
+}
+
+static void handle_msg(const tx_msg_t *msg)
+{
+    tx_conn_t *conn;
+    switch (msg->type)
+    {
+    case TX_MSG_DATA:
+        push_item(msg->conn_id, msg->generation, &msg->item);
+        break;
+    case TX_MSG_CONFIRM:
+        conn = get_tx_conn(msg->conn_id, msg->generation, false);
+        if (!conn || !conn->in_flight || conn->items[conn->head].handle != msg->confirm.handle)
+        {
+            // not sent by us
+            break;
+        }
+        if (msg->confirm.status == ESP_GATT_OK)
+        {
+            atomic_fetch_add(&tx_stats.sent, 1);
+            record_latency(&conn->items[conn->head], xTaskGetTickCount());
+            pop_item(conn);
+        }
+        else
+        {
+            ESP_LOGW(GATTS_TX_TAG, "conn_id=%d send failed, status=%d", msg->conn_id, msg->confirm.status);
+            retry_item(conn, xTaskGetTickCount());
+        }
+        break;
+    case TX_MSG_CONGEST:
+        conn = get_tx_conn(msg->conn_id, msg->generation, msg->congested && msg->generation);
+        if (conn)
+        {
+            if (msg->congested && !conn->congested)
+            {
+                atomic_fetch_add(&tx_stats.congestions, 1);
+            }
+            conn->congested = msg->congested;
+            ESP_LOGD(GATTS_TX_TAG, "conn_id=%d congested=%d, queued=%d", msg->conn_id, msg->congested, conn->count);
+        }
+        break;
+    case TX_MSG_DISCONNECT:
+        conn = get_tx_conn(msg->conn_id, msg->generation, false);
+        if (conn)
+        {
+            free_tx_conn(conn);
+        }
+        break;
+    }
+}
+
+static void service_conn(tx_conn_t *conn, TickType_t now)
+{
+    if (conn->in_flight)
+    {
+        if (now - conn->in_flight_since < TX_CONFIRM_TIMEOUT)
+        {
+            return;
+        }
+        // no feedback from the stack, assume it went out
+        atomic_fetch_add(&tx_stats.unconfirmed, 1);
+        pop_item(conn);
+    }
+
+    while (conn->count && !conn->in_flight)
+    {
+        tx_item_t *item = &conn->items[conn->head];
+        if (item->deadline && (int32_t)(now - item->deadline) > 0)
+        {
+            // also while congested, a late button press is worse than none
+            atomic_fetch_add(&tx_stats.dropped_stale, 1);
+            ESP_LOGW(GATTS_TX_TAG, "conn_id=%d item %lu ms past deadline, dropping",
+                     conn->conn_id, pdTICKS_TO_MS(now - item->deadline));
+            pop_item(conn);
+            continue;
+        }
+
+        if (conn->congested || (conn->retry_at && (int32_t)(now - conn->retry_at) < 0))
+        {
+            break;
+        }
+
+        esp_err_t err = esp_ble_gatts_send_indicate(item->gatts_if, conn->conn_id, item->handle,
+                                                    item->len, item->data, false);
+        if (err == ESP_OK)
+        {
+            trace_record(TRACE_NOTIFY, conn->conn_id, item->handle, item->data, item->len);
+            conn->in_flight = true;
+            conn->in_flight_since = now;
+        }
+        else
+        {
+            ESP_LOGW(GATTS_TX_TAG, "conn_id=%d send_indicate failed: %d", conn->conn_id, err);
+            retry_item(conn, now);
+        }
+    }
+}
+
+static TickType_t ticks_until(TickType_t when, TickType_t now)
+{
+    return (int32_t)(when - now) > 0 ? when - now : 0;
+}
+
+// how long the task may sleep until some queue needs attention again
+static TickType_t next_wakeup(TickType_t now)
+{
+    TickType_t wait = portMAX_DELAY;
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        tx_conn_t *conn = &tx_conns[i];
+        if (!conn->in_use || !conn->count)
+        {
+            continue;
+        }
+
+        if (conn->in_flight)
+        {
+            TickType_t conn_wait = ticks_until(conn->in_flight_since + TX_CONFIRM_TIMEOUT, now);
+            wait = conn_wait < wait ? conn_wait : wait;
+            continue;
+        }
+        if (conn->retry_at && !conn->congested)
+        {
+            TickType_t conn_wait = ticks_until(conn->retry_at, now);
+            wait = conn_wait < wait ? conn_wait : wait;
+        }
+        if (conn->items[conn->head].deadline)
+        {
+            TickType_t conn_wait = ticks_until(conn->items[conn->head].deadline + 1, now);
+            wait = conn_wait < wait ? conn_wait : wait;
+        }
+    }
+    return wait;
+}
+
+static void gatts_tx_task(void *pvParameters)
+{
+    tx_msg_t msg;
+
+    ESP_LOGI(GATTS_TX_TAG, "task start");
+
+    while (1)
+    {
+        TickType_t wait = next_wakeup(xTaskGetTickCount());
+        if (xQueueReceive(tx_input_queue, &msg, wait))
+        {
+            handle_msg(&msg);
+            // handle everything that piled up before sending
+            while (xQueueReceive(tx_input_queue, &msg, 0))
+            {
+                handle_msg(&msg);
+            }
+        }
+
+        TickType_t now = xTaskGetTickCount();
+        for (int i = 0; i < MAX_CONNECTIONS; i++)
+        {
+            if (tx_conns[i].in_use)
+            {
+                service_conn(&tx_conns[i], now);
+            }
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+void dump_gatts_tx_stats()
+{
+    ESP_LOGI(GATTS_TX_TAG, "tx: queued=%u, sent=%u, retries=%u, unconfirmed=%u, congestions=%u, max_depth=%d",
+             atomic_load(&tx_stats.queued), atomic_load(&tx_stats.sent), atomic_load(&tx_stats.retries),
+             atomic_load(&tx_stats.unconfirmed), atomic_load(&tx_stats.congestions), atomic_load(&tx_stats.max_depth));
+    ESP_LOGI(GATTS_TX_TAG, "dropped: full=%u, stale=%u, failed=%u, disconnect=%u, old session=%u",
+             atomic_load(&tx_stats.dropped_full), atomic_load(&tx_stats.dropped_stale),
+             atomic_load(&tx_stats.dropped_failed), atomic_load(&tx_stats.dropped_disconnect),
+             atomic_load(&tx_stats.dropped_session));
+    histogram_dump(GATTS_TX_TAG, &tx_latency);
+    ESP_LOGI(GATTS_TX_TAG, "latency estimate: %u ms", atomic_load(&tx_latency_peak_ms));
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        int depth = atomic_load(&tx_depth[i]);
+        if (depth)
+        {
+            ESP_LOGI(GATTS_TX_TAG, "- conn_id=%u: %d queued", atomic_load(&tx_depth_conn_id[i]), depth);
+        }
+    }
+    if (tx_input_queue)
+    {
+        ESP_LOGI(GATTS_TX_TAG, "input queue: %u waiting", (unsigned int)uxQueueMessagesWaiting(tx_input_queue));
+    }
+}
+
+uint32_t gatts_tx_latency_ms()
+{
+    return atomic_load(&tx_latency_peak_ms);
+}
@@ -0,0 +1,33 @@
+#ifndef PGP_GATTS_TX_H
+#define PGP_GATTS_TX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_gatt_defs.h"
+#include "freertos/FreeRTOS.h"
+
+// everything we send fits into the default MTU
+#define GATTS_TX_MAX_LEN 20
+
+bool init_gatts_tx();
+
+// queue a notification to conn_id. never blocks, so it may be called from the BTC task.
+// generation is the session of conn_id the item is meant for, it is dropped once that has ended.
+// deadline is a tick count after which the item is dropped instead of sent, 0 for none.
+// returns false if the item was dropped right away.
+bool gatts_tx_send(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t generation, uint16_t handle,
+                   const uint8_t *data, uint16_t len, TickType_t deadline);
+
+// BTC task: feedback from ESP_GATTS_CONF_EVT, ESP_GATTS_CONGEST_EVT and ESP_GATTS_DISCONNECT_EVT.
+// gatts_tx_disconnect() must be called before the client state of conn_id is deleted.
+void gatts_tx_confirm(uint16_t conn_id, uint16_t handle, esp_gatt_status_t status);
+void gatts_tx_congest(uint16_t conn_id, bool congested);
+void gatts_tx_disconnect(uint16_t conn_id);
+
+// recent send to confirm latency in ms, rises quickly and decays slowly
+uint32_t gatts_tx_latency_ms();
+
+void dump_gatts_tx_stats();
+
+#endif /* PGP_GATTS_TX_H */
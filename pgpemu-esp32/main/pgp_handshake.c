@@ -3,31 +3,77 @@
 
 #include "esp_gatt_defs.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "pgp_handshake.h"
 
 #include "log_tags.h"
 #include "pgp_bluetooth.h"
 #include "pgp_cert.h"
-#include "pgp_gap.h"
+#include "pgp_conn_events.h"
 #include "pgp_gatts.h"
+#include "pgp_gatts_tx.h"
 #include "pgp_handshake_multi.h"
+#include "pgp_handshake_stats.h"
 
 // disable using random values for the keys and nonces for debugging
 static const bool use_debug_buffer_values = false;
 
+// generate state_0_nonce and the state 1 challenge. neither depends on data from the app.
+static void generate_state_1_chal(client_state_t *client_state)
+{
+    if (use_debug_buffer_values)
+    {
+        memset(client_state->state_0_nonce, 0x42, 16);
+    }
+    else
+    {
+        randomize_buffer(client_state->state_0_nonce, 16);
+    }
+
+    memset(client_state->state_1_chal, 0, sizeof(client_state->state_1_chal));
+
+    struct next_challenge *chal = (struct next_challenge *)client_state->state_1_chal;
+    generate_next_chal(0, client_state->session_key, client_state->state_0_nonce, chal);
+
+    client_state->state_1_chal[0] = 0x01;
+    client_state->has_state_1_chal = true;
+}
+
+// an indication carries at most mtu-3 bytes, the stack would cut off anything longer
+static void send_commands_indication(esp_gatt_if_t gatts_if, client_state_t *client_state, uint8_t *data, uint16_t len)
+{
+    if (!client_subscribed(client_state, SUBSCRIPTION_COMMANDS))
+    {
+        ESP_LOGW(HANDSHAKE_TAG, "conn_id=%d didn't enable commands notifications", client_state->conn_id);
+        count_prevented_send(SUBSCRIPTION_COMMANDS);
+        return;
+    }
+    if (len > client_state->mtu - 3)
+    {
+        ESP_LOGE(HANDSHAKE_TAG, "indication of %d b doesn't fit mtu=%d, conn_id=%d",
+                 len, client_state->mtu, client_state->conn_id);
+        return;
+    }
+    gatts_tx_send(gatts_if, client_state->conn_id, client_state->generation,
+                  certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL], data, len, 0);
+}
+
 void handle_pgp_handshake_first(esp_gatt_if_t gatts_if, uint16_t descr_value, uint16_t conn_id)
 {
     client_state_t *client_state = get_or_create_client_state_entry(conn_id);
     if (!client_state)
     {
         ESP_LOGE(HANDSHAKE_TAG, "couldn't get/create client state, conn_id=%d", conn_id);
+        handshake_stats_failure(HANDSHAKE_FAIL_NO_CLIENT_STATE, conn_id, NULL, -1, 2);
         return;
     }
 
+    client_state_begin_update(client_state);
+
     if (descr_value == 0x0001)
     {
-        client_state->notify = true;
+        set_client_subscription(client_state, SUBSCRIPTION_COMMANDS, true);
 
         uint8_t notify_data[4];
         memset(notify_data, 0, 4);
@@ -72,19 +118,28 @@ void handle_pgp_handshake_first(esp_gatt_if_t gatts_if, uint16_t descr_value, ui
         }
 
         ESP_LOGD(HANDSHAKE_TAG, "start CERT PAIRING, conn_id=%d", conn_id);
-        // the size of notify_data[] need less than MTU size
-        esp_ble_gatts_send_indicate(gatts_if, conn_id, certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL],
-                                    sizeof(notify_data), notify_data, false);
+        send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
+
+        if (client_state->cert_state == 0)
+        {
+            // the app needs several round trips to read chal_0, prepare the state 1 response meanwhile
+            int64_t precompute_start = esp_timer_get_time();
+            generate_state_1_chal(client_state);
+            handshake_stats_precompute_time(esp_timer_get_time() - precompute_start);
+        }
     }
     else if (descr_value == 0x0000)
     {
-        client_state->notify = false;
-        ESP_LOGD(HANDSHAKE_TAG, "notify disable, conn_id=%d", conn_id);
+        set_client_subscription(client_state, SUBSCRIPTION_COMMANDS, false);
     }
     else
     {
         ESP_LOGE(HANDSHAKE_TAG, "unknown/indicate value");
+        handshake_stats_failure(HANDSHAKE_FAIL_UNKNOWN_CCCD_VALUE, conn_id, client_state->remote_bda,
+                                client_state->cert_state, 2);
     }
+
+    client_state_end_update(client_state);
 }
 
 void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
@@ -95,14 +150,20 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
     if (!client_state)
     {
         ESP_LOGE(HANDSHAKE_TAG, "couldn't get client state, conn_id=%d", conn_id);
+        handshake_stats_failure(HANDSHAKE_FAIL_NO_CLIENT_STATE, conn_id, NULL, -1, datalen);
         return;
     }
 
+    int64_t handler_start = esp_timer_get_time();
+    int entry_state = client_state->cert_state;
+
     if (client_state->cert_state >= 1)
     {
         ESP_LOGD(HANDSHAKE_TAG, "Handshake state=%d, received %d b, conn_id=%d", client_state->cert_state, datalen, conn_id);
     }
 
+    client_state_begin_update(client_state);
+
     switch (client_state->cert_state)
     {
     case 0: // normal challenge+response entry point
@@ -114,44 +175,48 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
             memset(notify_data, 0, 4);
             notify_data[0] = 0x01;
 
-            if (use_debug_buffer_values)
-            {
-                memset(client_state->state_0_nonce, 0x42, 16);
-            }
-            else
+            // normally done right after sending chal_0
+            handshake_stats_precompute_used(client_state->has_state_1_chal);
+            if (!client_state->has_state_1_chal)
             {
-                randomize_buffer(client_state->state_0_nonce, 16);
+                generate_state_1_chal(client_state);
             }
 
-            uint8_t temp[52];
-            memset(temp, 0, sizeof(temp));
-
-            struct next_challenge *chal = (struct next_challenge *)temp;
-            generate_next_chal(0, client_state->session_key, client_state->state_0_nonce, chal);
-
-            temp[0] = 0x01;
-            memcpy(client_state->cert_buffer, temp, 52);
-
-            // ESP_LOG_BUFFER_HEX(HANDSHAKE_TAG, temp, sizeof(temp));
-            // ESP_LOG_BUFFER_HEX(HANDSHAKE_TAG, cert_buffer, 52);
+            memcpy(client_state->cert_buffer, client_state->state_1_chal, 52);
+            client_state->has_state_1_chal = false;
 
             esp_ble_gatts_set_attr_value(certificate_handle_table[IDX_CHAR_SFIDA_TO_CENTRAL_VAL], 52, client_state->cert_buffer);
-            esp_ble_gatts_send_indicate(gatts_if, conn_id, certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL], sizeof(notify_data), notify_data, false);
+            send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
 
             client_state->cert_state = 1;
         }
         else
         {
             ESP_LOGE(HANDSHAKE_TAG, "App sends incorrect len=%d", datalen);
+            handshake_stats_failure(HANDSHAKE_FAIL_INCORRECT_LEN, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
         }
         break;
     }
     case 1:
     {
+        if (datalen != sizeof(struct next_challenge))
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "App sends incorrect len=%d", datalen);
+            handshake_stats_failure(HANDSHAKE_FAIL_INCORRECT_LEN, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
+            break;
+        }
+
         // we need to decrypt and send challenge data from APP
         uint8_t temp[20];
         memset(temp, 0, sizeof(temp));
-        decrypt_next(prepare_buf, client_state->session_key, temp + 4);
+        if (!decrypt_next(prepare_buf, client_state->session_key, temp + 4))
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "hash mismatch in app challenge, conn_id=%d", conn_id);
+            handshake_stats_failure(HANDSHAKE_FAIL_HASH_MISMATCH, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
+        }
         temp[0] = 0x02;
 
         uint8_t notify_data[4];
@@ -167,19 +232,32 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
         memcpy(client_state->cert_buffer, temp, 20);
 
         esp_ble_gatts_set_attr_value(certificate_handle_table[IDX_CHAR_SFIDA_TO_CENTRAL_VAL], 20, client_state->cert_buffer);
-        esp_ble_gatts_send_indicate(gatts_if, conn_id, certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL], sizeof(notify_data), notify_data, false);
+        send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
 
         client_state->cert_state = 2;
         break;
     }
     case 2:
     {
+        if (datalen != sizeof(struct next_challenge))
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "App sends incorrect len=%d", datalen);
+            handshake_stats_failure(HANDSHAKE_FAIL_INCORRECT_LEN, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
+            break;
+        }
+
         // TODO: what do we use the data for?
         ESP_LOGD(HANDSHAKE_TAG, "OK");
 
         uint8_t temp[20];
         memset(temp, 0, sizeof(temp));
-        decrypt_next(prepare_buf, client_state->session_key, temp + 4);
+        if (!decrypt_next(prepare_buf, client_state->session_key, temp + 4))
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "hash mismatch in app response, conn_id=%d", conn_id);
+            handshake_stats_failure(HANDSHAKE_FAIL_HASH_MISMATCH, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
+        }
 
         if (esp_log_level_get(HANDSHAKE_TAG) >= ESP_LOG_DEBUG)
         {
@@ -198,14 +276,12 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
         }
 
         uint8_t notify_data[4] = {0x04, 0x00, 0x23, 0x00};
-        esp_ble_gatts_send_indicate(gatts_if,
-                                    conn_id,
-                                    certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL],
-                                    sizeof(notify_data), notify_data, false);
+        send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
 
         client_state->cert_state = 6;
+        handshake_stats_read_round_trips(false, client_state->read_round_trips, client_state->mtu);
         connection_start(conn_id);
-        advertise_if_needed();
+        conn_events_publish(CONN_EVENT_HANDSHAKE_COMPLETE, conn_id, 0, client_state->remote_bda);
         break;
     }
     case 3: // reconnection #1: entry point
@@ -220,17 +296,29 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
             }
 
             uint8_t notify_data[4] = {0x04, 0x00, 0x01, 0x00};
-            esp_ble_gatts_send_indicate(gatts_if,
-                                        conn_id,
-                                        certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL],
-                                        sizeof(notify_data), notify_data, false);
+            send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
 
             client_state->cert_state = 4;
         }
+        else
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "App sends incorrect len=%d", datalen);
+            handshake_stats_failure(HANDSHAKE_FAIL_INCORRECT_LEN, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
+        }
         break;
     }
     case 4: // reconnection #2
     {
+        // 4 byte header and the 32 byte reconnect challenge
+        if (datalen != 36)
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "App sends incorrect len=%d", datalen);
+            handshake_stats_failure(HANDSHAKE_FAIL_INCORRECT_LEN, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
+            break;
+        }
+
         ESP_LOGD(HANDSHAKE_TAG, "OK");
 
         memset(client_state->cert_buffer, 0, 4);
@@ -247,7 +335,7 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
         notify_data[0] = 0x05;
 
         esp_ble_gatts_set_attr_value(certificate_handle_table[IDX_CHAR_SFIDA_TO_CENTRAL_VAL], 20, client_state->cert_buffer);
-        esp_ble_gatts_send_indicate(gatts_if, conn_id, certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL], sizeof(notify_data), notify_data, false);
+        send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
 
         client_state->cert_state = 5;
         break;
@@ -260,20 +348,34 @@ void handle_pgp_handshake_second(esp_gatt_if_t gatts_if,
             ESP_LOGD(HANDSHAKE_TAG, "OK");
 
             uint8_t notify_data[4] = {0x04, 0x00, 0x02, 0x00};
-            esp_ble_gatts_send_indicate(gatts_if,
-                                        conn_id,
-                                        certificate_handle_table[IDX_CHAR_SFIDA_COMMANDS_VAL],
-                                        sizeof(notify_data), notify_data, false);
+            send_commands_indication(gatts_if, client_state, notify_data, sizeof(notify_data));
 
             client_state->cert_state = 6;
+            handshake_stats_read_round_trips(true, client_state->read_round_trips, client_state->mtu);
             connection_update(conn_id);
+            conn_events_publish(CONN_EVENT_RESUMED, conn_id, 0, client_state->remote_bda);
+        }
+        else
+        {
+            ESP_LOGE(HANDSHAKE_TAG, "App sends incorrect len=%d", datalen);
+            handshake_stats_failure(HANDSHAKE_FAIL_INCORRECT_LEN, conn_id, client_state->remote_bda,
+                                    client_state->cert_state, datalen);
         }
         break;
     }
     default:
         ESP_LOGE(HANDSHAKE_TAG, "Unhandled state: %d", client_state->cert_state);
+        handshake_stats_failure(HANDSHAKE_FAIL_UNHANDLED_STATE, conn_id, client_state->remote_bda,
+                                client_state->cert_state, datalen);
         break;
     }
+
+    client_state_end_update(client_state);
+
+    if (client_state->cert_state != entry_state)
+    {
+        handshake_stats_state_time(entry_state, esp_timer_get_time() - handler_start);
+    }
 }
 
 void pgp_handshake_disconnect(uint16_t conn_id)
@@ -1,3 +1,4 @@
+#include <stdatomic.h>
 #include <string.h>
 
 #include "esp_log.h"
@@ -6,34 +7,113 @@
 
 #include "pgp_handshake_multi.h"
 
-#include "led_output.h"
 #include "log_tags.h"
 
-static int active_connections = 0;
+static atomic_int active_connections = 0;
 
 #define MAX_CONNECTIONS CONFIG_BT_ACL_CONNECTIONS
 
+static const unsigned int CONN_ID_UNUSED = 0xffff;
+
 // map which cert_states index corresponds to which conn_id
-static uint16_t conn_id_map[MAX_CONNECTIONS] = {0};
+static atomic_uint conn_id_map[MAX_CONNECTIONS];
 
 // keep track of handshake state per connection
 static client_state_t client_states[MAX_CONNECTIONS] = {0};
 
+// seqlock per client_states entry, odd while the BTC task is modifying it
+static atomic_uint client_state_seq[MAX_CONNECTIONS];
+// nesting depth of client_state_begin_update (only touched by the BTC task)
+static int client_state_update_depth[MAX_CONNECTIONS] = {0};
+
+// last handed out session generation (only touched by the BTC task)
+static uint32_t last_generation = 0;
+
+// notifications not queued because the client wasn't subscribed or not set up yet
+static atomic_uint prevented_sends[SUBSCRIPTIONS];
+static const char *subscription_names[SUBSCRIPTIONS] = {
+    "commands",
+    "button",
+    "battery",
+};
+
 void init_handshake_multi()
 {
-    memset(conn_id_map, 0xff, sizeof(conn_id_map));
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        atomic_store(&conn_id_map[i], CONN_ID_UNUSED);
+        atomic_store(&client_state_seq[i], 0);
+    }
 }
 
 int get_active_connections()
 {
-    return active_connections;
+    return atomic_load(&active_connections);
+}
+
+void client_state_begin_update(client_state_t *entry)
+{
+    int idx = entry - client_states;
+    if (client_state_update_depth[idx]++ == 0)
+    {
+        atomic_fetch_add_explicit(&client_state_seq[idx], 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+}
+
+void client_state_end_update(client_state_t *entry)
+{
+    int idx = entry - client_states;
+    if (--client_state_update_depth[idx] == 0)
+    {
+        atomic_fetch_add_explicit(&client_state_seq[idx], 1, memory_order_release);
+    }
+}
+
+bool get_client_state_snapshot(int idx, client_state_t *out)
+{
+    if (idx < 0 || idx >= MAX_CONNECTIONS)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        unsigned int seq_before = atomic_load_explicit(&client_state_seq[idx], memory_order_acquire);
+        if ((seq_before & 1) == 0)
+        {
+            memcpy(out, &client_states[idx], sizeof(client_state_t));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&client_state_seq[idx], memory_order_relaxed) == seq_before)
+            {
+                return out->generation != 0;
+            }
+        }
+
+        // BTC task is writing this entry right now
+        taskYIELD();
+    }
+}
+
+bool get_client_state_snapshot_by_conn_id(uint16_t conn_id, client_state_t *out)
+{
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    {
+        if (atomic_load_explicit(&conn_id_map[i], memory_order_acquire) == conn_id)
+        {
+            // the slot may have been reused in between, so check the copy as well
+            return get_client_state_snapshot(i, out) && out->conn_id == conn_id;
+        }
+    }
+
+    return false;
 }
 
 client_state_t *get_client_state_entry(uint16_t conn_id)
 {
     for (int i = 0; i < MAX_CONNECTIONS; i++)
     {
-        if (conn_id_map[i] == conn_id)
+        if (atomic_load_explicit(&conn_id_map[i], memory_order_relaxed) == conn_id)
         {
             return &client_states[i];
         }
@@ -45,46 +125,62 @@ client_state_t *get_client_state_entry(uint16_t conn_id)
 client_state_t *get_or_create_client_state_entry(uint16_t conn_id)
 {
     // check if it exists
-    for (int i = 0; i < MAX_CONNECTIONS; i++)
+    client_state_t *entry = get_client_state_entry(conn_id);
+    if (entry)
     {
-        if (conn_id_map[i] == conn_id)
-        {
-            return &client_states[i];
-        }
+        return entry;
     }
 
     // look for an empty slot
     for (int i = 0; i < MAX_CONNECTIONS; i++)
     {
-        if (conn_id_map[i] == 0xffff)
+        if (atomic_load_explicit(&conn_id_map[i], memory_order_relaxed) == CONN_ID_UNUSED)
         {
-            conn_id_map[i] = conn_id;
+            entry = &client_states[i];
 
             // set default values
-            memset(&client_states[i], 0, sizeof(client_state_t));
-            client_states[i].conn_id = conn_id;
-            client_states[i].handshake_start = xTaskGetTickCount();
+            client_state_begin_update(entry);
+            memset(entry, 0, sizeof(client_state_t));
+            entry->generation = ++last_generation;
+            entry->conn_id = conn_id;
+            entry->mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+            entry->handshake_start = xTaskGetTickCount();
+            client_state_end_update(entry);
 
-            return &client_states[i];
+            atomic_store_explicit(&conn_id_map[i], conn_id, memory_order_release);
+
+            return entry;
         }
     }
 
     return NULL;
 }
 
-static void delete_client_state_entry(client_state_t *entry)
+client_state_t *get_client_state_entry_by_bda(const uint8_t *bda)
 {
-    // delete mapping
     for (int i = 0; i < MAX_CONNECTIONS; i++)
     {
-        if (conn_id_map[i] == entry->conn_id)
+        if (atomic_load_explicit(&conn_id_map[i], memory_order_relaxed) != CONN_ID_UNUSED &&
+            memcmp(client_states[i].remote_bda, bda, sizeof(esp_bd_addr_t)) == 0)
         {
-            conn_id_map[i] = 0xffff;
+            return &client_states[i];
         }
     }
 
+    return NULL;
+}
+
+static void delete_client_state_entry(client_state_t *entry)
+{
+    int idx = entry - client_states;
+
+    // delete mapping
+    atomic_store_explicit(&conn_id_map[idx], CONN_ID_UNUSED, memory_order_release);
+
     // zero out entry
+    client_state_begin_update(entry);
     memset(entry, 0, sizeof(client_state_t));
+    client_state_end_update(entry);
 }
 
 int get_cert_state(uint16_t conn_id)
@@ -97,27 +193,81 @@ int get_cert_state(uint16_t conn_id)
     return entry->cert_state;
 }
 
-void connection_start(uint16_t conn_id)
+void set_client_subscription(client_state_t *entry, subscription_t which, bool enabled)
+{
+    client_state_begin_update(entry);
+    if (enabled)
+    {
+        entry->subscriptions |= 1 << which;
+    }
+    else
+    {
+        entry->subscriptions &= ~(1 << which);
+    }
+    client_state_end_update(entry);
+    ESP_LOGD(HANDSHAKE_TAG, "conn_id=%d %s notify %s", entry->conn_id, subscription_names[which], enabled ? "on" : "off");
+}
+
+bool client_subscribed(const client_state_t *entry, subscription_t which)
+{
+    if (!entry || !(entry->subscriptions & (1 << which)))
+    {
+        return false;
+    }
+    return which == SUBSCRIPTION_COMMANDS || entry->cert_state == 6;
+}
+
+void count_prevented_send(subscription_t which)
 {
-    active_connections++;
+    atomic_fetch_add_explicit(&prevented_sends[which], 1, memory_order_relaxed);
+}
 
+void set_client_mtu(uint16_t conn_id, uint16_t mtu)
+{
     client_state_t *entry = get_client_state_entry(conn_id);
     if (!entry)
     {
-        ESP_LOGI(HANDSHAKE_TAG, "connection_start: conn_id %d unknown", conn_id);
+        ESP_LOGE(HANDSHAKE_TAG, "set_client_mtu: conn_id %d unknown", conn_id);
         return;
     }
-    if (active_connections == 1)
+    client_state_begin_update(entry);
+    entry->mtu = mtu;
+    client_state_end_update(entry);
+
+    // chal_0 is read with one read request plus read blob requests of mtu-1 bytes each
+    ESP_LOGI(HANDSHAKE_TAG, "conn_id=%d mtu=%d, chal_0 takes %d reads",
+             conn_id, mtu, (int)((CERT_BUFFER_LEN + mtu - 2) / (mtu - 1)));
+}
+
+void count_client_read(uint16_t conn_id)
+{
+    client_state_t *entry = get_client_state_entry(conn_id);
+    if (!entry || entry->cert_state == 6)
     {
-        // turn leds off
-        show_rgb_event(false, false, false, 0);
+        return;
     }
+    client_state_begin_update(entry);
+    entry->read_round_trips++;
+    client_state_end_update(entry);
+}
 
+void connection_start(uint16_t conn_id)
+{
+    int now_active = atomic_fetch_add(&active_connections, 1) + 1;
+
+    client_state_t *entry = get_client_state_entry(conn_id);
+    if (!entry)
+    {
+        ESP_LOGI(HANDSHAKE_TAG, "connection_start: conn_id %d unknown", conn_id);
+        return;
+    }
+    client_state_begin_update(entry);
     entry->conn_id = conn_id;
     entry->connection_start = xTaskGetTickCount();
+    client_state_end_update(entry);
 
     ESP_LOGI(HANDSHAKE_TAG, "conn_id=%d connected, active_connections=%d, handshake_duration=%lu ms",
-             conn_id, active_connections,
+             conn_id, now_active,
              pdTICKS_TO_MS(entry->connection_start - entry->handshake_start));
 }
 
@@ -129,22 +279,27 @@ void connection_update(uint16_t conn_id)
         ESP_LOGE(HANDSHAKE_TAG, "connection_update: conn_id %d unknown", conn_id);
         return;
     }
+    client_state_begin_update(entry);
     entry->reconnection_at = xTaskGetTickCount();
+    client_state_end_update(entry);
 }
 
 void connection_stop(uint16_t conn_id)
 {
-    active_connections--;
-    if (active_connections < 0)
+    // decrement but never below zero
+    int now_active = atomic_load(&active_connections);
+    while (now_active > 0 && !atomic_compare_exchange_weak(&active_connections, &now_active, now_active - 1))
+    {
+    }
+    if (now_active <= 0)
     {
         // I'm not entirely sure that we covered all paths so try to save something in case of mistakes
         ESP_LOGE(HANDSHAKE_TAG, "we counted connections wrong!");
-        active_connections = 0;
+        now_active = 0;
     }
-    if (active_connections == 0)
+    else
     {
-        // show blue as long as nobody is connected
-        show_rgb_event(false, false, true, 0);
+        now_active--;
     }
 
     client_state_t *entry = get_client_state_entry(conn_id);
@@ -154,8 +309,10 @@ void connection_stop(uint16_t conn_id)
         return;
     }
 
+    client_state_begin_update(entry);
     entry->connection_end = xTaskGetTickCount();
     entry->cert_state = 0;
+    client_state_end_update(entry);
 
     ESP_LOGI(HANDSHAKE_TAG, "conn_id=%d was connected for %lu ms", conn_id,
              pdTICKS_TO_MS(entry->connection_end - entry->connection_start));
@@ -166,8 +323,9 @@ void connection_stop(uint16_t conn_id)
 
 static void dump_client_state(int idx, client_state_t *entry)
 {
-    ESP_LOGI(HANDSHAKE_TAG, "%d: conn_id=%d, cert_state=%d, recon_key=%d, notify=%d",
-             idx, entry->conn_id, entry->cert_state, entry->has_reconnect_key, entry->notify);
+    ESP_LOGI(HANDSHAKE_TAG, "%d: conn_id=%d, gen=%lu, cert_state=%d, recon_key=%d, subscriptions=%x, mtu=%d, reads=%d",
+             idx, entry->conn_id, entry->generation, entry->cert_state, entry->has_reconnect_key, entry->subscriptions,
+             entry->mtu, entry->read_round_trips);
     ESP_LOGI(HANDSHAKE_TAG, "timestamps: hs=%lu, rc=%lu, cs=%lu, ce=%lu",
              entry->handshake_start, entry->reconnection_at,
              entry->connection_start, entry->connection_end);
@@ -181,36 +339,54 @@ static void dump_client_state(int idx, client_state_t *entry)
     ESP_LOG_BUFFER_HEX(HANDSHAKE_TAG, entry->reconnect_challenge, sizeof(entry->reconnect_challenge));
 }
 
+// this is called from the uart task, so only use snapshots
 void dump_client_states()
 {
-    ESP_LOGI(HANDSHAKE_TAG, "active_connections: %d", active_connections);
+    // static to keep it off the uart task stack
+    static client_state_t snapshot;
+
+    ESP_LOGI(HANDSHAKE_TAG, "active_connections: %d", get_active_connections());
     ESP_LOGI(HANDSHAKE_TAG, "conn_id_map:");
     for (int i = 0; i < MAX_CONNECTIONS; i++)
     {
-        ESP_LOGI(HANDSHAKE_TAG, "%d: %04x", i, conn_id_map[i]);
+        ESP_LOGI(HANDSHAKE_TAG, "%d: %04x", i, atomic_load(&conn_id_map[i]));
     }
 
     ESP_LOGI(HANDSHAKE_TAG, "client_states:");
     for (int i = 0; i < MAX_CONNECTIONS; i++)
     {
-        dump_client_state(i, &client_states[i]);
+        if (get_client_state_snapshot(i, &snapshot))
+        {
+            dump_client_state(i, &snapshot);
+        }
+        else
+        {
+            ESP_LOGI(HANDSHAKE_TAG, "%d: unused", i);
+        }
     }
 }
 
 void dump_client_connection_times()
 {
-    ESP_LOGI(HANDSHAKE_TAG, "active_connections: %d", active_connections);
+    static client_state_t snapshot;
+
+    ESP_LOGI(HANDSHAKE_TAG, "active_connections: %d", get_active_connections());
 
     TickType_t now = xTaskGetTickCount();
 
     for (int i = 0; i < MAX_CONNECTIONS; i++)
     {
-        client_state_t *entry = &client_states[i];
-        if (entry->connection_start)
+        if (get_client_state_snapshot(i, &snapshot) && snapshot.connection_start)
         {
-            ESP_LOGI(HANDSHAKE_TAG, "- conn_id=%d connected for %lu ms",
-                     entry->conn_id,
-                     pdTICKS_TO_MS(now - entry->connection_start));
+            ESP_LOGI(HANDSHAKE_TAG, "- conn_id=%d connected for %lu ms, mtu=%d, handshake reads=%d, subscriptions=%x",
+                     snapshot.conn_id,
+                     pdTICKS_TO_MS(now - snapshot.connection_start),
+                     snapshot.mtu, snapshot.read_round_trips, snapshot.subscriptions);
         }
     }
+
+    ESP_LOGI(HANDSHAKE_TAG, "notifications not sent to unsubscribed clients: commands=%u, button=%u, battery=%u",
+             atomic_load(&prevented_sends[SUBSCRIPTION_COMMANDS]),
+             atomic_load(&prevented_sends[SUBSCRIPTION_BUTTON]),
+             atomic_load(&prevented_sends[SUBSCRIPTION_BATTERY]));
 }
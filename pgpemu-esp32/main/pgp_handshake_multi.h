@@ -3,23 +3,51 @@
 
 #include <stdint.h>
 
+#include "esp_bt_defs.h"
+#include "esp_gatt_defs.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 static const size_t CERT_BUFFER_LEN = 378;
 
+// notifications a client can enable through a CCCD, bit numbers in client_state_t.subscriptions
+typedef enum
+{
+    SUBSCRIPTION_COMMANDS = 0,
+    SUBSCRIPTION_BUTTON,
+    SUBSCRIPTION_BATTERY,
+    SUBSCRIPTIONS,
+} subscription_t;
+
+// Client states are only modified from the BTC task (GATTS/GAP callbacks), which
+// must bracket changes with client_state_begin_update()/client_state_end_update().
+// Other tasks must not dereference entries, they get a consistent copy from
+// get_client_state_snapshot() instead which never blocks the BTC task.
 typedef struct
 {
+    // unique per session, 0 marks an unused slot
+    uint32_t generation;
+
     // esp bt connection id
     uint16_t conn_id;
+    esp_bd_addr_t remote_bda;
     int cert_state;
     // TODO: we probably need to save the remote mac address so that we associate a reconnecting client with its previous client state
     bool has_reconnect_key;
-    bool notify;
+    // CCCD state, bit (1 << subscription_t) is set while notifications are enabled
+    uint8_t subscriptions;
+
+    // negotiated ATT MTU, ESP_GATT_DEF_BLE_MTU_SIZE until ESP_GATTS_MTU_EVT
+    uint16_t mtu;
+    // ATT reads (including read blob requests) until the handshake finished
+    uint16_t read_round_trips;
 
     uint8_t cert_buffer[378];
 
     uint8_t state_0_nonce[16];
+    // state 1 challenge is prepared while the app reads chal_0
+    bool has_state_1_chal;
+    uint8_t state_1_chal[52];
 
     uint8_t the_challenge[16];
     uint8_t main_nonce[16];
@@ -35,16 +63,43 @@ void init_handshake_multi();
 
 int get_active_connections();
 
-// returns NULL when conn_id unknown
+// BTC task only: returns NULL when conn_id unknown
 client_state_t *get_client_state_entry(uint16_t conn_id);
-// returns NULL only if conn_id unknown and max connections reached
+// BTC task only: returns NULL only if conn_id unknown and max connections reached
 client_state_t *get_or_create_client_state_entry(uint16_t conn_id);
+// BTC task only: returns NULL when no connection with this address exists
+client_state_t *get_client_state_entry_by_bda(const uint8_t *bda);
+
+// BTC task only: mark entry as being modified (calls may be nested)
+void client_state_begin_update(client_state_t *entry);
+void client_state_end_update(client_state_t *entry);
+
+// any task: copy slot idx (0 to CONFIG_BT_ACL_CONNECTIONS-1) without locking.
+// returns false if the slot is unused.
+bool get_client_state_snapshot(int idx, client_state_t *out);
+
+// any task: like get_client_state_snapshot() but looks up the slot by conn_id.
+// must not be called by the BTC task between client_state_begin_update()/client_state_end_update().
+bool get_client_state_snapshot_by_conn_id(uint16_t conn_id, client_state_t *out);
 
 int get_cert_state(uint16_t conn_id);
 
+// BTC task only: store a CCCD write
+void set_client_subscription(client_state_t *entry, subscription_t which, bool enabled);
+// entry or snapshot: true if notifications of this kind would reach the app. button and battery
+// notifications also need a finished handshake, commands are part of the handshake.
+bool client_subscribed(const client_state_t *entry, subscription_t which);
+// any task: count a notification that wasn't queued because client_subscribed() was false
+void count_prevented_send(subscription_t which);
+
 void dump_client_states();
 void dump_client_connection_times();
 
+// BTC task only: store negotiated MTU for conn_id
+void set_client_mtu(uint16_t conn_id, uint16_t mtu);
+// BTC task only: count an ATT read if the handshake of conn_id is still running
+void count_client_read(uint16_t conn_id);
+
 void connection_start(uint16_t conn_id);
 void connection_update(uint16_t conn_id);
 void connection_stop(uint16_t conn_id);
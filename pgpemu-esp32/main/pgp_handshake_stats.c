@@ -0,0 +1,221 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "pgp_handshake_stats.h"
+
+#include "histogram.h"
+#include "log_tags.h"
+
+// all writes happen in the BTC task
+static histogram_t state_time[HANDSHAKE_STATES] = {
+    HISTOGRAM_INIT("state 0 -> 1", "us"),
+    HISTOGRAM_INIT("state 1 -> 2", "us"),
+    HISTOGRAM_INIT("state 2 -> 6", "us"),
+    HISTOGRAM_INIT("state 3 -> 4", "us"),
+    HISTOGRAM_INIT("state 4 -> 5", "us"),
+    HISTOGRAM_INIT("state 5 -> 6", "us"),
+    HISTOGRAM_INIT("state 6", "us"),
+};
+static histogram_t precompute_time = HISTOGRAM_INIT("state 1 precompute", "us");
+static uint32_t precompute_hits = 0, precompute_misses = 0;
+static histogram_t handshake_reads = HISTOGRAM_INIT("reads per handshake", "reads");
+static histogram_t reconnect_reads = HISTOGRAM_INIT("reads per reconnect", "reads");
+static histogram_t handshake_mtu = HISTOGRAM_INIT("mtu", "bytes");
+
+#define FAILURE_LOG_SIZE 16
+
+static const uint32_t FAILURE_STORE_MAGIC = 0x70677066;
+
+typedef struct
+{
+    // boot number and ms since that boot
+    uint32_t boot;
+    uint32_t timestamp_ms;
+    uint16_t conn_id;
+    uint16_t datalen;
+    int8_t cert_state;
+    uint8_t reason;
+    uint8_t bda[6];
+} handshake_failure_t;
+
+// survives soft resets (panic, watchdog, esp_restart), not power loss
+typedef struct
+{
+    uint32_t magic;
+    uint32_t boot_count;
+    // cert_state -1 (unknown) is counted in the last column
+    uint32_t counts[HANDSHAKE_FAIL_REASONS][HANDSHAKE_STATES + 1];
+    // total number of failures logged, newest is at (total_logged - 1) % FAILURE_LOG_SIZE
+    uint32_t total_logged;
+    handshake_failure_t log[FAILURE_LOG_SIZE];
+} handshake_failure_store_t;
+
+static RTC_NOINIT_ATTR handshake_failure_store_t failure_store;
+// seqlock for failure_store, odd while the BTC task is writing
+static atomic_uint failure_store_seq = 0;
+
+static const char *fail_reason_names[HANDSHAKE_FAIL_REASONS] = {
+    "no client state",
+    "incorrect len",
+    "hash mismatch",
+    "unhandled state",
+    "unknown cccd value",
+};
+
+void init_handshake_stats()
+{
+    esp_reset_reason_t reset_reason = esp_reset_reason();
+    bool cold_boot = reset_reason == ESP_RST_POWERON || reset_reason == ESP_RST_BROWNOUT;
+
+    if (cold_boot || failure_store.magic != FAILURE_STORE_MAGIC)
+    {
+        memset(&failure_store, 0, sizeof(failure_store));
+        failure_store.magic = FAILURE_STORE_MAGIC;
+    }
+    failure_store.boot_count++;
+}
+
+void handshake_stats_state_time(int cert_state, uint32_t us)
+{
+    if (cert_state < 0 || cert_state >= HANDSHAKE_STATES)
+    {
+        return;
+    }
+    histogram_add(&state_time[cert_state], us);
+}
+
+void handshake_stats_precompute_time(uint32_t us)
+{
+    histogram_add(&precompute_time, us);
+}
+
+void handshake_stats_precompute_used(bool hit)
+{
+    if (hit)
+    {
+        precompute_hits++;
+    }
+    else
+    {
+        precompute_misses++;
+    }
+}
+
+void handshake_stats_read_round_trips(bool reconnect, int reads, int mtu)
+{
+    histogram_add(reconnect ? &reconnect_reads : &handshake_reads, reads);
+    histogram_add(&handshake_mtu, mtu);
+}
+
+void dump_handshake_stats()
+{
+    ESP_LOGI(HANDSHAKE_TAG, "handshake handler times:");
+    for (int i = 0; i < HANDSHAKE_STATES; i++)
+    {
+        if (state_time[i].count)
+        {
+            histogram_dump(HANDSHAKE_TAG, &state_time[i]);
+        }
+    }
+    histogram_dump(HANDSHAKE_TAG, &precompute_time);
+    ESP_LOGI(HANDSHAKE_TAG, "state 1 precomputed: used=%lu, missing=%lu", precompute_hits, precompute_misses);
+    histogram_dump(HANDSHAKE_TAG, &handshake_reads);
+    histogram_dump(HANDSHAKE_TAG, &reconnect_reads);
+    histogram_dump(HANDSHAKE_TAG, &handshake_mtu);
+}
+
+void handshake_stats_failure(handshake_fail_reason_t reason, uint16_t conn_id, const uint8_t *bda,
+                             int cert_state, int datalen)
+{
+    if (reason < 0 || reason >= HANDSHAKE_FAIL_REASONS)
+    {
+        return;
+    }
+    int state_col = (cert_state >= 0 && cert_state < HANDSHAKE_STATES) ? cert_state : HANDSHAKE_STATES;
+
+    atomic_fetch_add_explicit(&failure_store_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    failure_store.counts[reason][state_col]++;
+
+    handshake_failure_t *record = &failure_store.log[failure_store.total_logged % FAILURE_LOG_SIZE];
+    record->boot = failure_store.boot_count;
+    record->timestamp_ms = esp_timer_get_time() / 1000;
+    record->conn_id = conn_id;
+    record->datalen = datalen;
+    record->cert_state = cert_state;
+    record->reason = reason;
+    if (bda)
+    {
+        memcpy(record->bda, bda, sizeof(record->bda));
+    }
+    else
+    {
+        memset(record->bda, 0, sizeof(record->bda));
+    }
+    failure_store.total_logged++;
+
+    atomic_fetch_add_explicit(&failure_store_seq, 1, memory_order_release);
+}
+
+void dump_handshake_failures()
+{
+    // static to keep it off the uart task stack
+    static handshake_failure_store_t snapshot;
+
+    while (true)
+    {
+        unsigned int seq_before = atomic_load_explicit(&failure_store_seq, memory_order_acquire);
+        if ((seq_before & 1) == 0)
+        {
+            memcpy(&snapshot, &failure_store, sizeof(snapshot));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&failure_store_seq, memory_order_relaxed) == seq_before)
+            {
+                break;
+            }
+        }
+        taskYIELD();
+    }
+
+    ESP_LOGI(HANDSHAKE_TAG, "handshake failures (boot %lu):", snapshot.boot_count);
+    for (int reason = 0; reason < HANDSHAKE_FAIL_REASONS; reason++)
+    {
+        for (int state = 0; state <= HANDSHAKE_STATES; state++)
+        {
+            if (snapshot.counts[reason][state])
+            {
+                if (state == HANDSHAKE_STATES)
+                {
+                    ESP_LOGI(HANDSHAKE_TAG, "- %s, state ?: %lu", fail_reason_names[reason], snapshot.counts[reason][state]);
+                }
+                else
+                {
+                    ESP_LOGI(HANDSHAKE_TAG, "- %s, state %d: %lu", fail_reason_names[reason], state, snapshot.counts[reason][state]);
+                }
+            }
+        }
+    }
+
+    uint32_t count = snapshot.total_logged < FAILURE_LOG_SIZE ? snapshot.total_logged : FAILURE_LOG_SIZE;
+    ESP_LOGI(HANDSHAKE_TAG, "last %lu of %lu failures:", count, snapshot.total_logged);
+    for (uint32_t i = snapshot.total_logged - count; i < snapshot.total_logged; i++)
+    {
+        handshake_failure_t *record = &snapshot.log[i % FAILURE_LOG_SIZE];
+        ESP_LOGI(HANDSHAKE_TAG, "- boot %lu at %lu ms: %s, conn_id=%d, mac=%02x:%02x:%02x:%02x:%02x:%02x, state=%d, len=%d",
+                 record->boot, record->timestamp_ms,
+                 record->reason < HANDSHAKE_FAIL_REASONS ? fail_reason_names[record->reason] : "?",
+                 record->conn_id,
+                 record->bda[0], record->bda[1], record->bda[2],
+                 record->bda[3], record->bda[4], record->bda[5],
+                 record->cert_state, record->datalen);
+    }
+}
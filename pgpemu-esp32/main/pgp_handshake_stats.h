@@ -0,0 +1,42 @@
+#ifndef PGP_HANDSHAKE_STATS_H
+#define PGP_HANDSHAKE_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// handshake cert_states are 0-6
+#define HANDSHAKE_STATES 7
+
+typedef enum
+{
+    HANDSHAKE_FAIL_NO_CLIENT_STATE,
+    HANDSHAKE_FAIL_INCORRECT_LEN,
+    HANDSHAKE_FAIL_HASH_MISMATCH,
+    HANDSHAKE_FAIL_UNHANDLED_STATE,
+    HANDSHAKE_FAIL_UNKNOWN_CCCD_VALUE,
+    HANDSHAKE_FAIL_REASONS,
+} handshake_fail_reason_t;
+
+// restore failure counters and log from RTC memory, call early at boot
+void init_handshake_stats();
+
+// time spent in the handler of the given state until the response was sent
+void handshake_stats_state_time(int cert_state, uint32_t us);
+// time spent precomputing the state 1 challenge after chal_0 was sent
+void handshake_stats_precompute_time(uint32_t us);
+// state 0 handler found the state 1 challenge precomputed (or not)
+void handshake_stats_precompute_used(bool hit);
+
+// ATT reads the app needed until the handshake (or reconnection) finished, and at which MTU
+void handshake_stats_read_round_trips(bool reconnect, int reads, int mtu);
+
+void dump_handshake_stats();
+
+// BTC task only. bda may be NULL if unknown, cert_state -1 if unknown.
+void handshake_stats_failure(handshake_fail_reason_t reason, uint16_t conn_id, const uint8_t *bda,
+                             int cert_state, int datalen);
+
+// failure counters and the most recent failures, also from before the last soft reset
+void dump_handshake_failures();
+
+#endif /* PGP_HANDSHAKE_STATS_H */
@@ -2,188 +2,153 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 
+#include "esp_cpu.h"
 #include "esp_gatt_defs.h"
 #include "esp_log.h"
 #include "esp_system.h"
-#include "esp_random.h"
 #include "esp_mac.h"
 
+#include "pgp_led_handler.h"
+
+#include "gameplay_stats.h"
+#include "histogram.h"
 #include "led_output.h"
+#include "led_rules.h"
 #include "log_tags.h"
 #include "pgp_autobutton.h"
+#include "pgp_handshake_multi.h"
+#include "pgp_led_pattern.h"
 #include "settings.h"
 
 static const int led_duration_ms = 200;
 
-void handle_led_notify_from_app(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *buffer)
-{
-    int number_of_patterns = buffer[3] & 0x1f;
-    int priority = (buffer[3] >> 5) & 0x7;
-
-    ESP_LOGD(LEDHANDLER_TAG, "LED: Pattern count=%d, priority=%d", number_of_patterns, priority);
+// only touched by the BTC task
+static histogram_t classify_time = HISTOGRAM_INIT("led pattern classify (cached)", "cycles");
+static uint32_t event_counts[LED_EVENTS] = {0};
+static uint32_t malformed_writes = 0;
+static led_cache_t led_cache = {0};
 
-    // total duration / 50 ms
-    int pattern_duration = 0;
-    // number of shakes when catching
-    int count_ballshake = 0;
-    // how many times does each color occur in the pattern?
-    int count_red = 0;
-    int count_green = 0;
-    int count_blue = 0;
-    int count_yellow = 0;
-    int count_white = 0;
-    int count_other = 0; // colors like pink which aren't used
-    int count_off = 0, count_notoff = 0;
+void init_led_handler()
+{
+    init_led_patterns();
+    init_led_rules();
+}
 
-    // 1 pattern = 3 bytes
-    for (int i = 0; i < number_of_patterns; i++)
+// default feedback of an event, unless a rule replaces it
+static void show_feedback(const led_action_t *rule, bool red, bool green, bool blue, int duration_ms)
+{
+    if (!(rule->feedback & LED_FEEDBACK_SET))
     {
-        int p = 4 + 3 * i;
-        const uint8_t *pat = &buffer[p];
-
-        uint8_t duration = pat[0];
-        uint8_t red = pat[1] & 0xf;
-        uint8_t green = (pat[1] >> 4) & 0xf;
-        uint8_t blue = pat[2] & 0xf;
-        bool interpolate = (pat[2] & 0x80) != 0;
-        char inter_ch = interpolate ? 'i' : ' ';
-        bool vibration = (pat[2] & 0x70) != 0;
-        char vib_ch = vibration ? 'v' : ' ';
-        ESP_LOGD(LEDHANDLER_TAG, "*(%3d) #%x%x%x %c%c", duration, red, green, blue, vib_ch, inter_ch);
-
-        pattern_duration += duration;
+        show_rgb_event(red, green, blue, duration_ms);
+    }
+}
 
-        // parse colors roughly
-        if (!red && !green && !blue)
+void dump_led_handler_stats()
+{
+    histogram_dump(LEDHANDLER_TAG, &classify_time);
+    ESP_LOGI(LEDHANDLER_TAG, "malformed writes: %lu", malformed_writes);
+    uint32_t lookups = led_cache.hits + led_cache.misses;
+    ESP_LOGI(LEDHANDLER_TAG, "pattern cache: hits=%lu, misses=%lu, hit rate=%lu%%",
+             led_cache.hits, led_cache.misses, lookups ? 100 * led_cache.hits / lookups : 0);
+    ESP_LOGI(LEDHANDLER_TAG, "led events:");
+    for (int i = 0; i < LED_EVENTS; i++)
+    {
+        if (event_counts[i])
         {
-            count_off++;
+            ESP_LOGI(LEDHANDLER_TAG, "- %s: %lu", led_event_names[i], event_counts[i]);
         }
-        else
-        {
-            count_notoff++;
+    }
+}
 
-            // special hack to detect blinking white at the start (beginning of catch animation)
-            // this pattern is up to 3 times:
-            // D (629037) PGPEMU: *(3) #888
-            // D (629037) PGPEMU: *(9) #000
-            // D (629047) PGPEMU: *(16) #000
-            if (i <= 3 * 3)
-            {
-                if (red && green && blue)
-                {
-                    count_ballshake++;
-                }
-            }
+void handle_led_notify_from_app(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *buffer, uint16_t len)
+{
+    led_pattern_t pattern;
 
-            if (red && !green && !blue)
-            {
-                count_red++;
-            }
-            else if (!red && green && !blue)
-            {
-                count_green++;
-            }
-            else if (!red && !green && blue)
-            {
-                count_blue++;
-            }
-            else if (red && green && !blue)
-            {
-                count_yellow++;
-            }
-            else if (red && green && blue)
-            {
-                count_white++;
-            }
-            else
-            {
-                count_other++;
-            }
-        }
+    uint32_t classify_start = esp_cpu_get_cycle_count();
+    led_event_t event;
+    if (!led_pattern_classify_cached(&led_cache, buffer, len, &pattern, &event))
+    {
+        malformed_writes++;
+        ESP_LOGE(LEDHANDLER_TAG, "LED write of %d bytes can't hold %d patterns, conn_id=%d", len, pattern.count, conn_id);
+        return;
     }
+    histogram_add(&classify_time, esp_cpu_get_cycle_count() - classify_start);
+    event_counts[event]++;
+    gameplay_stats_record(conn_id, event, pattern.ballshakes);
+    autobutton_led_event(conn_id, event);
 
-    ESP_LOGI(LEDHANDLER_TAG, "LED pattern total duration: %d ms, conn_id=%d, Event:", pattern_duration * 50, conn_id);
+    ESP_LOGD(LEDHANDLER_TAG, "LED: Pattern count=%d, priority=%d, signature=%02x",
+             pattern.count, pattern.priority, pattern.signature);
+    ESP_LOGI(LEDHANDLER_TAG, "LED pattern total duration: %d ms, conn_id=%d, Event:", pattern.duration * 50, conn_id);
 
     const bool show_interactions = get_setting(&settings.led_interactions);
+    const led_action_t rule = led_rules_lookup(pattern.signature);
     bool press_button = false;
 
-    if (count_off && !count_notoff)
+    switch (event)
     {
+    case LED_EVENT_OFF:
         ESP_LOGD(LEDHANDLER_TAG, "Turn LEDs off.");
-    }
-    else if (count_white && count_white == count_notoff)
-    {
+        break;
+    case LED_EVENT_BAG_FULL:
         // only white
         ESP_LOGW(LEDHANDLER_TAG, "Can't spin Pokestop. Bag is full.");
-        show_rgb_event(true, false, false, 3 * led_duration_ms);
-    }
-    else if (count_red && count_off && count_red == count_notoff)
-    {
+        show_feedback(&rule, true, false, false, 3 * led_duration_ms);
+        break;
+    case LED_EVENT_BALLS_EMPTY:
         // blinking just red
         ESP_LOGW(LEDHANDLER_TAG, "Pokeballs are empty or Pokestop went out of range.");
-        show_rgb_event(true, false, false, 1 * led_duration_ms);
-    }
-    else if (count_red && !count_off && count_red == count_notoff)
-    {
+        show_feedback(&rule, true, false, false, 1 * led_duration_ms);
+        break;
+    case LED_EVENT_BOX_FULL:
         // only red
         ESP_LOGW(LEDHANDLER_TAG, "Can't catch Pokemon. Box is full.");
-        show_rgb_event(true, false, false, 3 * led_duration_ms);
-    }
-    else if (count_green && count_green == count_notoff)
-    {
+        show_feedback(&rule, true, false, false, 3 * led_duration_ms);
+        break;
+    case LED_EVENT_POKEMON:
         // blinking green
         ESP_LOGI(LEDHANDLER_TAG, "Pokemon in range!");
         if (get_setting(&settings.autocatch))
         {
             press_button = true;
         }
-    }
-    else if (count_yellow && count_yellow == count_notoff)
-    {
+        break;
+    case LED_EVENT_NEW_POKEMON:
         // blinking yellow
         ESP_LOGI(LEDHANDLER_TAG, "New Pokemon in range!");
         press_button = true;
-    }
-    else if (count_blue && count_blue == count_notoff)
-    {
+        break;
+    case LED_EVENT_POKESTOP:
         // blinking blue
         ESP_LOGI(LEDHANDLER_TAG, "Pokestop in range!");
         if (get_setting(&settings.autospin))
         {
             press_button = true;
         }
-    }
-    else if (count_ballshake)
-    {
-        if (count_blue && count_green)
-        {
-            if (show_interactions) {
-                show_rgb_event(false, true, false, led_duration_ms); // green
-            }
-            ESP_LOGI(LEDHANDLER_TAG, "Caught Pokemon after %d ball shakes.", count_ballshake);
-        }
-        else if (count_red)
-        {
-            if (show_interactions) {
-                show_rgb_event(true, false, true, led_duration_ms); // pink
-            }
-            ESP_LOGI(LEDHANDLER_TAG, "Pokemon fled after %d ball shakes.", count_ballshake);
+        break;
+    case LED_EVENT_CAUGHT:
+        if (show_interactions) {
+            show_feedback(&rule, false, true, false, led_duration_ms); // green
         }
-        else
-        {
-            ESP_LOGE(LEDHANDLER_TAG, "I don't know what the Pokemon did after %d ball shakes.", count_ballshake);
+        ESP_LOGI(LEDHANDLER_TAG, "Caught Pokemon after %d ball shakes.", pattern.ballshakes);
+        break;
+    case LED_EVENT_FLED:
+        if (show_interactions) {
+            show_feedback(&rule, true, false, true, led_duration_ms); // pink
         }
-    }
-    else if (count_red && count_green && count_blue && !count_off)
-    {
+        ESP_LOGI(LEDHANDLER_TAG, "Pokemon fled after %d ball shakes.", pattern.ballshakes);
+        break;
+    case LED_EVENT_SHAKE_UNKNOWN:
+        ESP_LOGE(LEDHANDLER_TAG, "I don't know what the Pokemon did after %d ball shakes.", pattern.ballshakes);
+        break;
+    case LED_EVENT_ITEMS:
         if (show_interactions) {
-            show_rgb_event(false, false, true, led_duration_ms); // blue
+            show_feedback(&rule, false, false, true, led_duration_ms); // blue
         }
         // blinking grb-grb...
         ESP_LOGI(LEDHANDLER_TAG, "Got items from Pokestop.");
-    }
-    else
-    {
+        break;
+    default:
         if (get_setting(&settings.autospin) || get_setting(&settings.autocatch))
         {
             ESP_LOGE(LEDHANDLER_TAG, "Unhandled Color pattern, pushing button in any case");
@@ -193,23 +158,34 @@ void handle_led_notify_from_app(esp_gatt_if_t gatts_if, uint16_t conn_id, const
         {
             ESP_LOGE(LEDHANDLER_TAG, "Unhandled Color pattern");
         }
+        break;
     }
 
-    if (press_button)
+    if ((rule.feedback & LED_FEEDBACK_SET) &&
+        (rule.feedback & (LED_FEEDBACK_RED | LED_FEEDBACK_GREEN | LED_FEEDBACK_BLUE)))
     {
-        int pattern_ms = pattern_duration * 50;
+        show_rgb_event(rule.feedback & LED_FEEDBACK_RED, rule.feedback & LED_FEEDBACK_GREEN,
+                       rule.feedback & LED_FEEDBACK_BLUE, led_duration_ms);
+    }
+    if (rule.action != LED_ACTION_DEFAULT)
+    {
+        ESP_LOGI(LEDHANDLER_TAG, "rule for signature %02x: %s", pattern.signature,
+                 rule.action == LED_ACTION_PRESS ? "pressing" : "not pressing");
+        press_button = rule.action == LED_ACTION_PRESS;
+    }
 
-        // random button press delay between 1000 and 2500 ms
-        int delay = 1000 + esp_random() % 1501;
-        if (delay < pattern_ms)
+    if (press_button)
+    {
+        if (!client_subscribed(get_client_state_entry(conn_id), SUBSCRIPTION_BUTTON))
         {
-            ESP_LOGD(LEDHANDLER_TAG, "queueing push button after %d ms, conn_id=%d", delay, conn_id);
-
-            button_queue_item_t item;
-            item.gatts_if = gatts_if;
-            item.conn_id = conn_id;
-            item.delay = delay;
-            xQueueSend(button_queue, &item, portMAX_DELAY);
+            // the app would never see the press
+            ESP_LOGW(LEDHANDLER_TAG, "conn_id=%d isn't subscribed to the button, not pressing", conn_id);
+            count_prevented_send(SUBSCRIPTION_BUTTON);
+        }
+        else
+        {
+            autobutton_schedule_press(gatts_if, conn_id, event, pattern.duration * 50,
+                                      rule.delay_min * 100, rule.delay_max * 100);
         }
     }
 }
@@ -5,6 +5,13 @@
 
 #include "esp_gatt_defs.h"
 
-void handle_led_notify_from_app(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *buffer);
+// build the led pattern classification table
+void init_led_handler();
+
+// BTC task: classify an LED characteristic write and queue a button press if needed
+void handle_led_notify_from_app(esp_gatt_if_t gatts_if, uint16_t conn_id, const uint8_t *buffer, uint16_t len);
+
+// print classification timing and event counters
+void dump_led_handler_stats();
 
 #endif /* PGP_LED_HANDLER_H */
@@ -0,0 +1,237 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pgp_led_pattern.h"
+
+const char *const led_event_names[LED_EVENTS] = {
+    [LED_EVENT_UNKNOWN] = "unknown",
+    [LED_EVENT_OFF] = "off",
+    [LED_EVENT_BAG_FULL] = "bag full",
+    [LED_EVENT_BALLS_EMPTY] = "balls empty",
+    [LED_EVENT_BOX_FULL] = "box full",
+    [LED_EVENT_POKEMON] = "pokemon",
+    [LED_EVENT_NEW_POKEMON] = "new pokemon",
+    [LED_EVENT_POKESTOP] = "pokestop",
+    [LED_EVENT_CAUGHT] = "caught",
+    [LED_EVENT_FLED] = "fled",
+    [LED_EVENT_SHAKE_UNKNOWN] = "shake unknown",
+    [LED_EVENT_ITEMS] = "items",
+};
+
+// one entry per possible signature
+static uint8_t classify_table[256];
+
+void init_led_patterns()
+{
+    for (int sig = 0; sig < 256; sig++)
+    {
+        classify_table[sig] = led_pattern_decide(sig);
+    }
+}
+
+// color bit for one entry, 4 bits per channel
+static uint8_t color_bit(uint8_t red, uint8_t green, uint8_t blue)
+{
+    // index is r | g << 1 | b << 2, each channel just on or off
+    static const uint8_t color_bits[8] = {
+        LED_SIG_OFF,    // ---
+        LED_SIG_RED,    // r--
+        LED_SIG_GREEN,  // -g-
+        LED_SIG_YELLOW, // rg-
+        LED_SIG_BLUE,   // --b
+        LED_SIG_OTHER,  // r-b
+        LED_SIG_OTHER,  // -gb
+        LED_SIG_WHITE,  // rgb
+    };
+    return color_bits[(red != 0) | (green != 0) << 1 | (blue != 0) << 2];
+}
+
+bool led_pattern_parse(const uint8_t *buffer, uint16_t len, led_pattern_t *out)
+{
+    out->signature = 0;
+    out->ballshakes = 0;
+    out->duration = 0;
+    out->count = 0;
+    out->priority = 0;
+
+    if (len < LED_PATTERN_HEADER_LEN)
+    {
+        return false;
+    }
+    out->count = buffer[3] & 0x1f;
+    out->priority = (buffer[3] >> 5) & 0x7;
+    if (len < LED_PATTERN_HEADER_LEN + LED_PATTERN_ENTRY_LEN * out->count)
+    {
+        return false;
+    }
+
+    // 1 pattern = 3 bytes: duration, green << 4 | red, interpolate << 7 | vibration << 4 | blue
+    const uint8_t *pat = buffer + LED_PATTERN_HEADER_LEN;
+    for (int i = 0; i < out->count; i++, pat += LED_PATTERN_ENTRY_LEN)
+    {
+        uint8_t bit = color_bit(pat[1] & 0xf, pat[1] >> 4, pat[2] & 0xf);
+        out->duration += pat[0];
+        out->signature |= bit;
+
+        // the catch animation starts with up to 3 times: *(3) #888, *(9) #000, *(16) #000
+        if (bit == LED_SIG_WHITE && i <= 3 * 3)
+        {
+            out->ballshakes++;
+        }
+    }
+    if (out->ballshakes)
+    {
+        out->signature |= LED_SIG_BALLSHAKE;
+    }
+    return true;
+}
+
+led_event_t led_pattern_classify(uint8_t signature)
+{
+    return classify_table[signature];
+}
+
+uint64_t led_pattern_hash(const uint8_t *buffer, uint16_t len)
+{
+    // FNV-1a, but on 64 bit words so it stays cheaper than parsing
+    uint64_t hash = 14695981039346656037ull ^ len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buffer + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; i++)
+    {
+        hash ^= buffer[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool led_pattern_classify_cached(led_cache_t *cache, const uint8_t *buffer, uint16_t len,
+                                 led_pattern_t *pattern, led_event_t *event)
+{
+    // the length is part of the hash, so the full 64 bits are the key
+    uint64_t hash = led_pattern_hash(buffer, len);
+    led_cache_set_t *set = &cache->sets[(hash >> 32) & (LED_CACHE_SETS - 1)];
+    for (int way = 0; way < 2; way++)
+    {
+        led_cache_entry_t *entry = &set->ways[way];
+        if (entry->valid && entry->hash == hash)
+        {
+            cache->hits++;
+            set->lru = !way;
+            *pattern = entry->pattern;
+            *event = entry->event;
+            return true;
+        }
+    }
+
+    cache->misses++;
+    if (!led_pattern_parse(buffer, len, pattern))
+    {
+        return false;
+    }
+    *event = led_pattern_classify(pattern->signature);
+
+    // replace the least recently used way
+    led_cache_entry_t *entry = &set->ways[set->lru];
+    set->lru = !set->lru;
+    entry->valid = true;
+    entry->hash = hash;
+    entry->event = *event;
+    entry->pattern = *pattern;
+    return true;
+}
+
+led_event_t led_pattern_decide(uint8_t signature)
+{
+    uint8_t colors = signature & LED_SIG_COLORS;
+    bool off = signature & LED_SIG_OFF;
+
+    if (off && !colors)
+    {
+        return LED_EVENT_OFF;
+    }
+    if (colors == LED_SIG_WHITE)
+    {
+        return LED_EVENT_BAG_FULL;
+    }
+    if (colors == LED_SIG_RED)
+    {
+        // blinking red or only red
+        return off ? LED_EVENT_BALLS_EMPTY : LED_EVENT_BOX_FULL;
+    }
+    if (colors == LED_SIG_GREEN)
+    {
+        return LED_EVENT_POKEMON;
+    }
+    if (colors == LED_SIG_YELLOW)
+    {
+        return LED_EVENT_NEW_POKEMON;
+    }
+    if (colors == LED_SIG_BLUE)
+    {
+        return LED_EVENT_POKESTOP;
+    }
+    if (signature & LED_SIG_BALLSHAKE)
+    {
+        if ((colors & LED_SIG_BLUE) && (colors & LED_SIG_GREEN))
+        {
+            return LED_EVENT_CAUGHT;
+        }
+        if (colors & LED_SIG_RED)
+        {
+            return LED_EVENT_FLED;
+        }
+        return LED_EVENT_SHAKE_UNKNOWN;
+    }
+    if ((colors & LED_SIG_RED) && (colors & LED_SIG_GREEN) && (colors & LED_SIG_BLUE) && !off)
+    {
+        // blinking grb-grb...
+        return LED_EVENT_ITEMS;
+    }
+    return LED_EVENT_UNKNOWN;
+}
+
+bool led_rule_valid(const led_rule_t *rule)
+{
+    if (rule->then.action >= LED_ACTIONS)
+    {
+        return false;
+    }
+    if (rule->then.feedback & ~(LED_FEEDBACK_SET | LED_FEEDBACK_RED | LED_FEEDBACK_GREEN | LED_FEEDBACK_BLUE))
+    {
+        return false;
+    }
+    // colors without LED_FEEDBACK_SET would neither be shown nor leave the default feedback alone
+    if (rule->then.feedback && !(rule->then.feedback & LED_FEEDBACK_SET))
+    {
+        return false;
+    }
+    if (rule->then.delay_min && rule->then.delay_max && rule->then.delay_min > rule->then.delay_max)
+    {
+        return false;
+    }
+    return true;
+}
+
+void led_rules_compile(const led_rule_t *rules, int count, led_action_t table[256])
+{
+    memset(table, 0, 256 * sizeof(led_action_t));
+    for (int i = 0; i < count; i++)
+    {
+        for (int sig = 0; sig < 256; sig++)
+        {
+            if (((sig ^ rules[i].value) & rules[i].mask) == 0)
+            {
+                table[sig] = rules[i].then;
+            }
+        }
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef PGP_LED_PATTERN_H
+#define PGP_LED_PATTERN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// LED pattern parsing and classification. No ESP-IDF dependencies so it can be tested on PC (see pc/led-test.c).
+
+// color signature bits, set if at least one pattern entry has that color
+#define LED_SIG_OFF (1 << 0)
+#define LED_SIG_RED (1 << 1)
+#define LED_SIG_GREEN (1 << 2)
+#define LED_SIG_BLUE (1 << 3)
+#define LED_SIG_YELLOW (1 << 4)
+#define LED_SIG_WHITE (1 << 5)
+// colors like pink which aren't used
+#define LED_SIG_OTHER (1 << 6)
+// white within the first 10 entries (blinking at the start of the catch animation)
+#define LED_SIG_BALLSHAKE (1 << 7)
+
+#define LED_SIG_COLORS (LED_SIG_RED | LED_SIG_GREEN | LED_SIG_BLUE | LED_SIG_YELLOW | LED_SIG_WHITE | LED_SIG_OTHER)
+
+typedef enum
+{
+    LED_EVENT_UNKNOWN = 0,
+    LED_EVENT_OFF,
+    LED_EVENT_BAG_FULL,
+    LED_EVENT_BALLS_EMPTY,
+    LED_EVENT_BOX_FULL,
+    LED_EVENT_POKEMON,
+    LED_EVENT_NEW_POKEMON,
+    LED_EVENT_POKESTOP,
+    LED_EVENT_CAUGHT,
+    LED_EVENT_FLED,
+    LED_EVENT_SHAKE_UNKNOWN,
+    LED_EVENT_ITEMS,
+    LED_EVENTS,
+} led_event_t;
+
+typedef struct
+{
+    uint8_t signature;
+    // number of pattern entries and their priority from the header
+    uint8_t count;
+    uint8_t priority;
+    // white entries within the first 10
+    uint8_t ballshakes;
+    // total duration in 50 ms units
+    uint16_t duration;
+} led_pattern_t;
+
+// 2 entries per set, must be a power of two
+#define LED_CACHE_SETS 32
+
+typedef struct
+{
+    bool valid;
+    led_event_t event;
+    led_pattern_t pattern;
+    // 64 bit hash of the write including its length, collisions are negligible at this size
+    uint64_t hash;
+} led_cache_entry_t;
+
+typedef struct
+{
+    led_cache_entry_t ways[2];
+    // way to replace next
+    uint8_t lru;
+} led_cache_set_t;
+
+// 2-way set associative by a hash of the whole write, the app repeats the same few dozen patterns.
+// entries only hold what the write itself determines, settings and rules are applied after the lookup,
+// so they never need to be flushed.
+typedef struct
+{
+    uint32_t hits, misses;
+    led_cache_set_t sets[LED_CACHE_SETS];
+} led_cache_t;
+
+extern const char *const led_event_names[LED_EVENTS];
+
+// fill the classification table, call once before led_pattern_classify()
+void init_led_patterns();
+
+// 4 byte header, the entry count is in the last byte
+#define LED_PATTERN_HEADER_LEN 4
+#define LED_PATTERN_ENTRY_LEN 3
+
+// single pass over the pattern entries of an LED characteristic write of len bytes.
+// returns false if the write is shorter than its header says, nothing is read past len.
+bool led_pattern_parse(const uint8_t *buffer, uint16_t len, led_pattern_t *out);
+
+// table lookup
+led_event_t led_pattern_classify(uint8_t signature);
+
+// FNV-1a style hash over the write and its length, 8 bytes at a time
+uint64_t led_pattern_hash(const uint8_t *buffer, uint16_t len);
+
+// like led_pattern_parse() + led_pattern_classify(), but repeated writes are answered from the cache
+// without parsing. a zero initialized cache is empty.
+bool led_pattern_classify_cached(led_cache_t *cache, const uint8_t *buffer, uint16_t len,
+                                 led_pattern_t *pattern, led_event_t *event);
+
+// the rules the table is built from
+led_event_t led_pattern_decide(uint8_t signature);
+
+// user rules (see led_rules.c) override what happens for some signatures
+typedef enum
+{
+    // whatever the autocatch/autospin settings say
+    LED_ACTION_DEFAULT = 0,
+    LED_ACTION_PRESS,
+    LED_ACTION_IGNORE,
+    LED_ACTIONS,
+} led_action_type_t;
+
+#define LED_FEEDBACK_DEFAULT 0
+#define LED_FEEDBACK_RED (1 << 0)
+#define LED_FEEDBACK_GREEN (1 << 1)
+#define LED_FEEDBACK_BLUE (1 << 2)
+// show the color bits above instead of the default feedback (none if no color is set)
+#define LED_FEEDBACK_SET (1 << 7)
+
+// what to do for a signature, delays are in 100 ms units and 0 means the default
+typedef struct
+{
+    uint8_t action;
+    uint8_t feedback;
+    uint8_t delay_min;
+    uint8_t delay_max;
+} led_action_t;
+
+// matches every signature with (signature & mask) == (value & mask), as stored in nvs
+typedef struct
+{
+    uint8_t value;
+    uint8_t mask;
+    led_action_t then;
+} led_rule_t;
+
+// false if a field is out of range
+bool led_rule_valid(const led_rule_t *rule);
+
+// expand rules into one action per signature, later rules win
+void led_rules_compile(const led_rule_t *rules, int count, led_action_t table[256]);
+
+#endif /* PGP_LED_PATTERN_H */
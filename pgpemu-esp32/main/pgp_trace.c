@@ -0,0 +1,124 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp32/rom/crc.h"
+#include "esp_timer.h"
+#include "mbedtls/base64.h"
+
+#include "pgp_trace.h"
+
+typedef struct
+{
+    // 1 + position in the stream, 0 while the slot is being written
+    atomic_uint seq;
+    uint32_t timestamp_us;
+    uint16_t conn_id;
+    uint16_t handle;
+    // length of the original value, only the first captured bytes are kept
+    uint16_t len;
+    uint8_t event;
+    uint8_t captured;
+    uint8_t data[TRACE_DATA_LEN];
+} trace_entry_t;
+
+// frame on the wire: seq, timestamp_us, conn_id, handle, len, event, captured (all little endian),
+// data[captured], crc32 of everything before it
+#define TRACE_FRAME_HEADER_LEN (4 + 4 + 2 + 2 + 2 + 1 + 1)
+#define TRACE_FRAME_MAX_LEN (TRACE_FRAME_HEADER_LEN + TRACE_DATA_LEN + 4)
+
+static trace_entry_t trace_ring[TRACE_ENTRIES];
+// number of events ever recorded, writers reserve slots with fetch_add
+static atomic_uint trace_head = 0;
+
+void trace_record(trace_event_t event, uint16_t conn_id, uint16_t handle, const uint8_t *data, uint16_t len)
+{
+    unsigned int pos = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    trace_entry_t *entry = &trace_ring[pos & (TRACE_ENTRIES - 1)];
+
+    atomic_store_explicit(&entry->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    entry->timestamp_us = esp_timer_get_time();
+    entry->conn_id = conn_id;
+    entry->handle = handle;
+    entry->len = len;
+    entry->event = event;
+    entry->captured = 0;
+    if (data && len)
+    {
+        entry->captured = len < TRACE_DATA_LEN ? len : TRACE_DATA_LEN;
+        memcpy(entry->data, data, entry->captured);
+    }
+
+    atomic_store_explicit(&entry->seq, pos + 1, memory_order_release);
+}
+
+static void put_u16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value;
+    buf[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    put_u16(buf, value);
+    put_u16(buf + 2, value >> 16);
+}
+
+// copy a consistent entry, false if it was overwritten while copying
+static bool snapshot_entry(unsigned int pos, trace_entry_t *out)
+{
+    trace_entry_t *entry = &trace_ring[pos & (TRACE_ENTRIES - 1)];
+
+    if (atomic_load_explicit(&entry->seq, memory_order_acquire) != pos + 1)
+    {
+        return false;
+    }
+    memcpy(out, entry, sizeof(trace_entry_t));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&entry->seq, memory_order_relaxed) == pos + 1;
+}
+
+void trace_dump()
+{
+    // static to keep it off the uart task stack
+    static trace_entry_t snapshot;
+    static uint8_t frame[TRACE_FRAME_MAX_LEN];
+    static unsigned char line[((TRACE_FRAME_MAX_LEN + 2) / 3) * 4 + 1];
+
+    unsigned int head = atomic_load_explicit(&trace_head, memory_order_acquire);
+    unsigned int first = head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+    int skipped = 0;
+
+    printf("\nPGPTRACE BEGIN %u %u\n", head - first, first);
+    for (unsigned int pos = first; pos < head; pos++)
+    {
+        if (!snapshot_entry(pos, &snapshot))
+        {
+            // overwritten by a newer event since we started
+            skipped++;
+            continue;
+        }
+
+        put_u32(frame, pos);
+        put_u32(frame + 4, snapshot.timestamp_us);
+        put_u16(frame + 8, snapshot.conn_id);
+        put_u16(frame + 10, snapshot.handle);
+        put_u16(frame + 12, snapshot.len);
+        frame[14] = snapshot.event;
+        frame[15] = snapshot.captured;
+        memcpy(frame + TRACE_FRAME_HEADER_LEN, snapshot.data, snapshot.captured);
+        size_t frame_len = TRACE_FRAME_HEADER_LEN + snapshot.captured;
+        put_u32(frame + frame_len, crc32_le(0, frame, frame_len));
+        frame_len += 4;
+
+        size_t line_len = 0;
+        mbedtls_base64_encode(line, sizeof(line), &line_len, frame, frame_len);
+        line[line_len] = 0;
+        printf("PGPT %s\n", line);
+    }
+    printf("PGPTRACE END %d\n", skipped);
+    fflush(stdout);
+}
@@ -0,0 +1,33 @@
+#ifndef PGP_TRACE_H
+#define PGP_TRACE_H
+
+#include <stdint.h>
+
+// first bytes of each value kept in the trace, enough for every handshake header and led pattern header
+#define TRACE_DATA_LEN 20
+// must be a power of two
+#define TRACE_ENTRIES 128
+
+// stored as uint8_t, keep in sync with tools/trace_decode.py
+typedef enum
+{
+    TRACE_CONNECT = 0,
+    TRACE_DISCONNECT,
+    TRACE_MTU,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_PREP_WRITE,
+    TRACE_EXEC_WRITE,
+    TRACE_NOTIFY,
+    TRACE_CONF,
+    TRACE_EVENT_TYPES,
+} trace_event_t;
+
+// any task: record one event. costs a memcpy of at most TRACE_DATA_LEN bytes,
+// data may be NULL if len is 0 or carries a non-payload value (mtu, reason, status).
+void trace_record(trace_event_t event, uint16_t conn_id, uint16_t handle, const uint8_t *data, uint16_t len);
+
+// print the ring as framed base64 lines for tools/trace_decode.py
+void trace_dump();
+
+#endif /* PGP_TRACE_H */
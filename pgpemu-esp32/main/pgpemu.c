@@ -4,12 +4,18 @@
 #include "button_input.h"
 #include "config_secrets.h"
 #include "config_storage.h"
+#include "gameplay_stats.h"
 #include "led_output.h"
 #include "log_tags.h"
+#include "pgp_conn_events.h"
+#include "pgp_conn_params.h"
 #include "pgp_autobutton.h"
 #include "pgp_bluetooth.h"
 #include "pgp_gap.h"
 #include "pgp_gatts.h"
+#include "pgp_gatts_tx.h"
+#include "pgp_handshake_stats.h"
+#include "pgp_led_handler.h"
 #include "powerbank.h"
 #include "secrets.h"
 #include "settings.h"
@@ -34,6 +40,9 @@ void app_main()
         vTaskDelay(60000 / portTICK_PERIOD_MS);
     }
 
+    // restore handshake failure log kept in rtc memory
+    init_handshake_stats();
+
     // init nvs storage
     init_config_storage();
 
@@ -54,6 +63,9 @@ void app_main()
         log_levels_min();
     }
 
+    // connection lifecycle events, must be started before anybody subscribes
+    init_conn_events();
+
     // rgb led
     if (settings.use_led)
     {
@@ -95,6 +107,24 @@ void app_main()
 
     // runtime counter
     init_stats();
+    init_gameplay_stats();
+
+    // queue for outgoing notifications
+    if (!init_gatts_tx())
+    {
+        ESP_LOGI(PGPEMU_TAG, "creating tx task failed");
+        return;
+    }
+
+    // connection parameter policy
+    if (!init_conn_params())
+    {
+        ESP_LOGI(PGPEMU_TAG, "creating conn params task failed");
+        return;
+    }
+
+    // led pattern classification table
+    init_led_handler();
 
     // start autobutton task
     if (!init_autobutton())
@@ -6,19 +6,52 @@
 #include "stats.h"
 
 #include "log_tags.h"
+#include "pgp_conn_events.h"
 
 static void stats_task(void *pvParameters);
+static void stats_conn_event_handler(const conn_event_t *event);
 
 static const char *KEY_RUNTIME_10MIN = "runtime10min";
 
 static uint32_t runtime = 0;
 static const uint32_t runtime_max = 500; // only count until about 3 days to avoid flash wear
 
+// only written by the conn_events task
+static uint32_t count_connects = 0, count_handshakes = 0, count_resumes = 0, count_disconnects = 0;
+
 void init_stats()
 {
+    conn_events_subscribe(stats_conn_event_handler);
     xTaskCreate(stats_task, "stats_task", 2048, NULL, 9, NULL);
 }
 
+static void stats_conn_event_handler(const conn_event_t *event)
+{
+    switch (event->type)
+    {
+    case CONN_EVENT_CONNECTED:
+        count_connects++;
+        break;
+    case CONN_EVENT_HANDSHAKE_COMPLETE:
+        count_handshakes++;
+        break;
+    case CONN_EVENT_RESUMED:
+        count_resumes++;
+        break;
+    case CONN_EVENT_DISCONNECTED:
+        count_disconnects++;
+        break;
+    default:
+        break;
+    }
+}
+
+void stats_dump_connections()
+{
+    ESP_LOGI(STATS_TAG, "connects=%lu, handshakes=%lu, resumes=%lu, disconnects=%lu",
+             count_connects, count_handshakes, count_resumes, count_disconnects);
+}
+
 uint32_t stats_get_runtime()
 {
     return 10 * runtime;
@@ -5,4 +5,7 @@ void init_stats();
 
 uint32_t stats_get_runtime();
 
+// print connection counters since boot
+void stats_dump_connections();
+
 #endif /* STATS_H */
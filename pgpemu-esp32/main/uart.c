@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <string.h>
 
 #include "driver/uart.h"
@@ -9,10 +10,18 @@
 
 #include "config_secrets.h"
 #include "config_storage.h"
+#include "gameplay_stats.h"
+#include "led_rules.h"
 #include "log_tags.h"
+#include "pgp_autobutton.h"
+#include "pgp_conn_params.h"
 #include "pgp_gap.h"
 #include "pgp_gatts.h"
+#include "pgp_gatts_tx.h"
 #include "pgp_handshake_multi.h"
+#include "pgp_handshake_stats.h"
+#include "pgp_led_handler.h"
+#include "pgp_trace.h"
 #include "secrets.h"
 #include "settings.h"
 #include "stats.h"
@@ -31,6 +40,7 @@ static uint8_t tmp_blob[sizeof(PGP_BLOB)];
 static void uart_event_task(void *pvParameters);
 static void uart_secrets_handler();
 static void uart_target_connections_handler();
+static void uart_led_rules_handler();
 static bool decode_to_buf(char targetType, uint8_t *inBuf, int inBytes);
 static void uart_restart_command();
 
@@ -92,6 +102,16 @@ static void uart_event_task(void *pvParameters)
                     // show full client details
                     dump_client_states();
                 }
+                else if (dtmp[0] == 'H')
+                {
+                    // show handshake timing histograms
+                    dump_handshake_stats();
+                }
+                else if (dtmp[0] == 'F')
+                {
+                    // show handshake failure counters and log
+                    dump_handshake_failures();
+                }
                 else if (dtmp[0] == 's')
                 {
                     // toggle autospin
@@ -183,9 +203,34 @@ static void uart_event_task(void *pvParameters)
                         ESP_LOGI(UART_TAG, "success!");
                     }
                 }
+                else if (dtmp[0] == 'P')
+                {
+                    conn_params_dump();
+                }
+                else if (dtmp[0] == 'L')
+                {
+                    // led pattern classifier timing and counters
+                    dump_led_handler_stats();
+                }
+                else if (dtmp[0] == 'G')
+                {
+                    // catch/spin throughput per connection and stored hourly/daily totals
+                    dump_gameplay_stats();
+                }
+                else if (dtmp[0] == 'D')
+                {
+                    // binary gatt event trace, decode with tools/trace_decode.py
+                    trace_dump();
+                }
+                else if (dtmp[0] == 'Q')
+                {
+                    dump_gatts_tx_stats();
+                    dump_autobutton_stats();
+                }
                 else if (dtmp[0] == 'r')
                 {
                     ESP_LOGI(UART_TAG, "runtime: %lu min", stats_get_runtime());
+                    stats_dump_connections();
                 }
                 else if (dtmp[0] == 'R')
                 {
@@ -206,6 +251,11 @@ static void uart_event_task(void *pvParameters)
                     // enter secrets mode
                     uart_secrets_handler();
                 }
+                else if (dtmp[0] == 'u')
+                {
+                    // enter led rules mode
+                    uart_led_rules_handler();
+                }
                 else if (dtmp[0] == 'm')
                 {
                     uart_target_connections_handler();
@@ -227,11 +277,19 @@ static void uart_event_task(void *pvParameters)
                     ESP_LOGI(UART_TAG, "Commands:");
                     ESP_LOGI(UART_TAG, "- h,? - help");
                     ESP_LOGI(UART_TAG, "- X... - edit secrets mode (select eg. slot 2 with 'X2!')");
+                    ESP_LOGI(UART_TAG, "- u - edit LED rules mode");
                     ESP_LOGI(UART_TAG, "- A - start BT advertising");
                     ESP_LOGI(UART_TAG, "- a - stop BT advertising");
                     ESP_LOGI(UART_TAG, "- t - show BT connection times");
                     ESP_LOGI(UART_TAG, "- C - show BT client states");
-                    ESP_LOGI(UART_TAG, "- r - show runtime counter");
+                    ESP_LOGI(UART_TAG, "- H - show BT handshake timings");
+                    ESP_LOGI(UART_TAG, "- F - show BT handshake failures");
+                    ESP_LOGI(UART_TAG, "- P - show BT connection parameters");
+                    ESP_LOGI(UART_TAG, "- Q - show BT transmit queue and button press stats");
+                    ESP_LOGI(UART_TAG, "- L - show LED pattern classifier stats");
+                    ESP_LOGI(UART_TAG, "- G - show gameplay counters (catches, spins, ...)");
+                    ESP_LOGI(UART_TAG, "- D - dump BT event trace (decode with tools/trace_decode.py)");
+                    ESP_LOGI(UART_TAG, "- r - show runtime and connection counters");
                     ESP_LOGI(UART_TAG, "- T - show FreeRTOS task list");
                     ESP_LOGI(UART_TAG, "- R - restart");
                 }
@@ -605,3 +663,171 @@ static void uart_target_connections_handler()
         ESP_LOGE(UART_TAG, "failed editing setting");
     }
 }
+
+// "a <sig> <mask> <p|i|d> <d|0|rgb> [<min ms> <max ms>]", see the help in uart_led_rules_handler()
+static bool parse_led_rule(const char *line, led_rule_t *rule)
+{
+    unsigned int value = 0, mask = 0;
+    char action = 0;
+    char led[8] = {0};
+    int min_ms = 0, max_ms = 0;
+
+    int n = sscanf(line, " %x %x %c %7s %d %d", &value, &mask, &action, led, &min_ms, &max_ms);
+    if (n != 4 && n != 6)
+    {
+        return false;
+    }
+    if (value > 0xff || mask > 0xff || min_ms < 0 || max_ms < 0 || min_ms > 25500 || max_ms > 25500)
+    {
+        return false;
+    }
+
+    memset(rule, 0, sizeof(*rule));
+    rule->value = value;
+    rule->mask = mask;
+    switch (action)
+    {
+    case 'p':
+        rule->then.action = LED_ACTION_PRESS;
+        break;
+    case 'i':
+        rule->then.action = LED_ACTION_IGNORE;
+        break;
+    case 'd':
+        rule->then.action = LED_ACTION_DEFAULT;
+        break;
+    default:
+        return false;
+    }
+
+    if (strcmp(led, "d") != 0)
+    {
+        rule->then.feedback = LED_FEEDBACK_SET;
+        for (int i = 0; led[i] && strcmp(led, "0") != 0; i++)
+        {
+            switch (led[i])
+            {
+            case 'r':
+                rule->then.feedback |= LED_FEEDBACK_RED;
+                break;
+            case 'g':
+                rule->then.feedback |= LED_FEEDBACK_GREEN;
+                break;
+            case 'b':
+                rule->then.feedback |= LED_FEEDBACK_BLUE;
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+
+    rule->then.delay_min = (min_ms + 50) / 100;
+    rule->then.delay_max = (max_ms + 50) / 100;
+    return led_rule_valid(rule);
+}
+
+static void uart_led_rules_handler()
+{
+    // one line of input
+    char buf[64];
+    int pos = 0;
+
+    ESP_LOGW(UART_TAG, "LED rules mode, 'h' for help");
+    fflush(stdout);
+
+    bool running = true;
+    while (running)
+    {
+        int size = uart_read_bytes(EX_UART_NUM, (uint8_t *)buf + pos, 1, 30000 / portTICK_PERIOD_MS);
+        if (size != 1)
+        {
+            // timeout, leave rules mode
+            break;
+        }
+        if (buf[pos] != '\n' && buf[pos] != '\r')
+        {
+            if (pos < sizeof(buf) - 1)
+            {
+                pos++;
+            }
+            continue;
+        }
+        buf[pos] = 0;
+        pos = 0;
+
+        led_rule_t rule;
+        int idx;
+        switch (buf[0])
+        {
+        case 0:
+            // empty line
+            break;
+
+        case '?':
+        case 'h':
+            ESP_LOGW(UART_TAG, "LED Rules Mode");
+            ESP_LOGI(UART_TAG, "Rules match the color signature of a pattern (bits in pgp_led_pattern.h, verbose");
+            ESP_LOGI(UART_TAG, "logging shows it for each pattern) where the mask bits are set, later rules win.");
+            ESP_LOGI(UART_TAG, "- h,? - help");
+            ESP_LOGI(UART_TAG, "- q - leave rules mode");
+            ESP_LOGI(UART_TAG, "- l - list rules");
+            ESP_LOGI(UART_TAG, "- a <sig> <mask> <p|i|d> <d|0|rgb> [<min ms> <max ms>] - add rule:");
+            ESP_LOGI(UART_TAG, "  sig/mask in hex, press/ignore/default, led default/off/colors, press delay range");
+            ESP_LOGI(UART_TAG, "  eg. 'a 04 7e i 0' never presses for green-only patterns (pokemon in range)");
+            ESP_LOGI(UART_TAG, "- d <n> - delete rule n");
+            ESP_LOGI(UART_TAG, "- C - delete all rules");
+            ESP_LOGI(UART_TAG, "- W - save rules permanently");
+            break;
+
+        case 'l':
+            led_rules_dump();
+            break;
+
+        case 'a':
+            if (!parse_led_rule(buf + 1, &rule))
+            {
+                ESP_LOGE(UART_TAG, "invalid rule '%s'", buf);
+            }
+            else if (!led_rules_add(&rule))
+            {
+                ESP_LOGE(UART_TAG, "too many rules (max. %d)", LED_RULES_MAX);
+            }
+            else
+            {
+                led_rules_dump();
+            }
+            break;
+
+        case 'd':
+            if (sscanf(buf + 1, "%d", &idx) != 1 || !led_rules_delete(idx))
+            {
+                ESP_LOGE(UART_TAG, "no rule '%s'", buf + 1);
+            }
+            else
+            {
+                led_rules_dump();
+            }
+            break;
+
+        case 'C':
+            led_rules_clear();
+            ESP_LOGW(UART_TAG, "all rules deleted");
+            break;
+
+        case 'W':
+            ESP_LOGW(UART_TAG, "save=%d", led_rules_save());
+            break;
+
+        case 'q':
+            running = false;
+            break;
+
+        default:
+            ESP_LOGE(UART_TAG, "invalid command '%c'", buf[0]);
+        }
+        fflush(stdout);
+    }
+
+    ESP_LOGW(UART_TAG, "left LED rules mode");
+}
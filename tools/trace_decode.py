@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""decode the gatt event trace printed by the 'D' uart command
+run with: ./trace_decode.py console.log [--pcap trace.pcap]
+
+console.log is a capture of the serial console (eg. from idf.py monitor or
+`cat /dev/ttyUSB0 > console.log`), log lines around the trace are ignored.
+"""
+
+import argparse
+import base64
+import binascii
+import struct
+import sys
+from typing import Iterable, List, NamedTuple, TextIO
+
+# keep in sync with trace_event_t in pgpemu-esp32/main/pgp_trace.h
+EVENT_NAMES = [
+    "CONNECT",
+    "DISCONNECT",
+    "MTU",
+    "READ",
+    "WRITE",
+    "PREP_WRITE",
+    "EXEC_WRITE",
+    "NOTIFY",
+    "CONF",
+]
+
+# events where len is a value instead of a payload length
+VALUE_LABELS = {
+    "DISCONNECT": "reason",
+    "MTU": "mtu",
+    "READ": "offset",
+    "EXEC_WRITE": "flag",
+    "CONF": "status",
+}
+
+HEADER = struct.Struct("<IIHHHBB")
+
+# pcap with one record per packet, see --pcap
+LINKTYPE_USER0 = 147
+
+
+class TraceEvent(NamedTuple):
+    seq: int
+    timestamp_us: int
+    conn_id: int
+    handle: int
+    length: int
+    event: int
+    data: bytes
+    raw: bytes
+
+    @property
+    def name(self) -> str:
+        if self.event < len(EVENT_NAMES):
+            return EVENT_NAMES[self.event]
+        return f"EVENT_{self.event}"
+
+
+def parse_frame(line: str) -> TraceEvent:
+    frame = base64.b64decode(line, validate=True)
+    if len(frame) < HEADER.size + 4:
+        raise ValueError("frame too short")
+    body, crc = frame[:-4], struct.unpack("<I", frame[-4:])[0]
+    if binascii.crc32(body) != crc:
+        raise ValueError("crc mismatch")
+
+    seq, timestamp_us, conn_id, handle, length, event, captured = HEADER.unpack_from(body)
+    data = body[HEADER.size:]
+    if len(data) != captured:
+        raise ValueError("captured length mismatch")
+    return TraceEvent(seq, timestamp_us, conn_id, handle, length, event, data, body)
+
+
+def read_dumps(lines: Iterable[str]) -> List[List[TraceEvent]]:
+    dumps = []
+    current = None
+    for lineno, line in enumerate(lines, 1):
+        line = line.strip()
+        if line.startswith("PGPTRACE BEGIN"):
+            current = []
+            dumps.append(current)
+        elif line.startswith("PGPTRACE END"):
+            skipped = int(line.split()[2])
+            if skipped:
+                print(f"line {lineno}: {skipped} events were overwritten during the dump", file=sys.stderr)
+            current = None
+        elif line.startswith("PGPT ") and current is not None:
+            try:
+                current.append(parse_frame(line[5:]))
+            except (ValueError, binascii.Error) as e:
+                print(f"line {lineno}: dropping frame: {e}", file=sys.stderr)
+    return dumps
+
+
+def unwrap_timestamps(events: List[TraceEvent]) -> List[int]:
+    # timestamp_us is the lower 32 bits of esp_timer_get_time() and wraps after ~71 minutes
+    result = []
+    offset = 0
+    last = None
+    for event in events:
+        if last is not None and event.timestamp_us < last:
+            offset += 1 << 32
+        last = event.timestamp_us
+        result.append(event.timestamp_us + offset)
+    return result
+
+
+def print_timeline(events: List[TraceEvent], out: TextIO) -> None:
+    if not events:
+        print("empty trace", file=out)
+        return
+
+    timestamps = unwrap_timestamps(events)
+    start = timestamps[0]
+    last_seq = events[0].seq - 1
+    for event, ts in zip(events, timestamps):
+        if event.seq != last_seq + 1:
+            print(f"{'':>12}  ... {event.seq - last_seq - 1} events missing", file=out)
+        last_seq = event.seq
+
+        line = f"{(ts - start) / 1000:12.3f}  conn={event.conn_id:<2} {event.name:<10}"
+        if event.handle:
+            line += f" handle={event.handle:<3}"
+        if event.name in VALUE_LABELS:
+            line += f" {VALUE_LABELS[event.name]}={event.length}"
+        elif event.name == "CONNECT":
+            line += " mac=" + ":".join(f"{b:02x}" for b in event.data)
+        else:
+            truncated = "..." if event.length > len(event.data) else ""
+            line += f" len={event.length:<3} {event.data.hex()}{truncated}"
+        print(line, file=out)
+
+
+def write_pcap(events: List[TraceEvent], path: str) -> None:
+    timestamps = unwrap_timestamps(events)
+    with open(path, "wb") as f:
+        f.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, LINKTYPE_USER0))
+        for event, ts in zip(events, timestamps):
+            f.write(struct.pack("<IIII", ts // 1000000, ts % 1000000, len(event.raw), len(event.raw)))
+            f.write(event.raw)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("log", help="captured serial console, - for stdin")
+    parser.add_argument("--pcap", help="also write the last dump as pcap (LINKTYPE_USER0, one trace record per packet)")
+    args = parser.parse_args()
+
+    if args.log == "-":
+        dumps = read_dumps(sys.stdin)
+    else:
+        with open(args.log, "r", errors="replace") as f:
+            dumps = read_dumps(f)
+
+    if not dumps:
+        print("no PGPTRACE dump found", file=sys.stderr)
+        return 1
+
+    for i, events in enumerate(dumps):
+        if len(dumps) > 1:
+            print(f"dump {i + 1} of {len(dumps)}:")
+        print_timeline(events, sys.stdout)
+
+    if args.pcap:
+        write_pcap(dumps[-1], args.pcap)
+        print(f"wrote {len(dumps[-1])} events to {args.pcap}", file=sys.stderr)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())